@@ -1,9 +1,18 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define MAX_LINE 200
 #define MAX_SEARCH_LEN 20
@@ -16,3 +25,412 @@
 #define L_ARGUMENT_INVALID 6
 #define WILDCARD_INVALID 7
 #define DUPLICATE_ARGUMENT 8
+
+#define INDEX_OPTION 256
+#define IN_PLACE_OPTION 257
+#define JOURNAL_OPTION 258
+#define WATCH_OPTION 259
+#define CLIENT_OPTION 260
+#define STATS_OPTION 261
+#define BINARY_OPTION 262
+#define DIFF_OPTION 263
+#define WORD_OPTION 264
+#define PROGRESS_OPTION 265
+#define RULES_OPTION 266
+#define SHARD_OPTION 267
+#define CACHE_OPTION 268
+#define MAX_COUNT_OPTION 269
+#define FIELD_OPTION 270
+#define DELIM_OPTION 271
+#define FUZZY_OPTION 272
+#define MAP_OPTION 273
+
+#define SOCKET_ENVIRONMENT "HW5_SOCKET"
+
+#define INDEX_EXTENSION ".lidx"
+#define INDEX_STRIDE 1024
+#define COPY_CHUNK 65536
+#define SCAN_BLOCK 64
+#define FUZZY_MAX_PIECES 16
+#define QUOTE '"'
+#define JOURNAL_EXTENSION ".journal"
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+#define FILE_TEXT 0
+#define FILE_BINARY 1
+#define SNIFF_SIZE 8192
+#define SNIFF_INVALID_PERCENT 30
+
+#define DIFF_NONE 0
+#define DIFF_UNIFIED 1
+#define DIFF_PATCH 2
+#define DIFF_CONTEXT 3
+
+#define BINARY_PASS 0
+#define BINARY_SKIP 1
+#define BINARY_TEXT 2
+
+#define CACHE_NO_MATCH 0
+#define CACHE_MATCH 1
+
+#define PLAN_LINES 0
+#define PLAN_PASSTHROUGH 1
+#define PLAN_SPANS 2
+#define PLAN_REWRITE 3
+#define PLAN_FIELDS 4
+#define PLAN_RANGES 5
+
+#define MARKER_LITERAL 0
+#define MARKER_PREFIX 1
+#define MARKER_SUFFIX 2
+
+/**
+ * @brief Growable byte buffer, always NUL-terminated once something was appended
+ */
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} text_buffer;
+
+/**
+ * @brief Counters reported by --stats
+ */
+typedef struct
+{
+    const char *input;       // Name of the input file
+    struct timespec started; // When the run started
+    int binary;              // FILE_TEXT or FILE_BINARY, as classified by sniff_file()
+    uint64_t lines;          // Lines run through the replacement engine
+    uint64_t replacements;   // Replacements made
+    uint64_t bytes_copied;   // Bytes copied to the output without being scanned
+    uint64_t cache_hits;     // Inputs whose result came from the --cache directory
+    int plan;                // PLAN_LINES, or the strategy run_plan() picked for the input
+    uint64_t sampled_bytes;  // Bytes of the input the planner sampled
+    uint64_t sampled_hits;   // Prefilter hits in those bytes
+} replace_stats;
+
+/**
+ * @brief Live counters reported on SIGUSR1 and by --progress
+ */
+typedef struct
+{
+    _Atomic uint64_t bytes;   // Input bytes processed so far
+    _Atomic uint64_t line;    // Line being processed
+    _Atomic uint64_t matches; // Replacements made so far
+    uint64_t total;           // Size of the input, 0 if unknown
+    unsigned interval;        // Seconds between reports, 0 to report only on SIGUSR1
+    struct timespec started;  // When reporting started
+    uint64_t last_bytes;      // Bytes processed at the previous report
+    struct timespec last_time; // Instant of the previous report
+    pthread_t reporter;       // Thread printing the reports, started only with an interval
+    _Atomic int done;         // Set to stop the reporter
+} progress_counter;
+
+/**
+ * @brief Node of a rule trie; the children of a node are chained through their siblings
+ */
+typedef struct
+{
+    unsigned char byte; // Byte leading to this node
+    int32_t child;      // First child, -1 if none
+    int32_t sibling;    // Next child of the same parent, -1 if none
+    int32_t rule;       // Rule whose affix ends here, -1 if none
+} trie_node;
+
+/**
+ * @brief One wildcard rule of a rule set
+ */
+typedef struct
+{
+    size_t replacement;        // Offset of the text replacing matching words in the rule set's strings
+    size_t replacement_length; // Length of the replacement
+    size_t affix_length;       // Length of the pattern without its '*'
+} wildcard_rule;
+
+/**
+ * @brief Wildcard rules compiled into a prefix trie and a trie of reversed suffixes
+ *
+ * When several rules match a word, the one with the longest affix wins, then the earliest.
+ */
+typedef struct
+{
+    wildcard_rule *rules;
+    size_t count;
+    size_t capacity;
+    trie_node *prefixes; // Node 0 is the root
+    size_t prefix_count;
+    size_t prefix_capacity;
+    trie_node *suffixes; // Node 0 is the root; suffixes are inserted last byte first
+    size_t suffix_count;
+    size_t suffix_capacity;
+    text_buffer strings; // Replacements, back to back
+    uint64_t digest;     // FNV-1a of every pattern and replacement, in order
+    void *mapping;       // Compiled file the arrays live in, NULL when they were built in memory
+    size_t mapping_length;
+} rule_set;
+
+/**
+ * @brief One entry of a word map, as offsets into the map's strings
+ */
+typedef struct
+{
+    size_t key;          // Offset of the key
+    size_t key_length;   // Length of the key
+    size_t value;        // Offset of the value
+    size_t value_length; // Length of the value
+} map_entry;
+
+/**
+ * @brief Whole-word rename map, looked up through a minimal perfect hash of its keys
+ *
+ * A key hashes to a bucket; the bucket's seed rehashes its keys to slots no other key takes, so a
+ * lookup costs two hashes and at most one key compare whatever the size of the map.
+ */
+typedef struct
+{
+    text_buffer strings; // Keys and values, back to back
+    map_entry *entries; // In the order they were added; the first of equal keys wins
+    size_t count;
+    size_t capacity;
+    int32_t *seeds;     // Per bucket: seed of its slots, or -slot - 1 for a bucket of one key
+    uint64_t *slots;    // Per slot: fingerprint of its key in the high half, its entry in the low half
+    size_t slot_count;  // Distinct keys, one slot each
+    size_t shortest;    // Length of the shortest key
+    size_t longest;     // Length of the longest key
+    uint64_t digest;    // FNV-1a of every key and value, in order
+    void *mapping;      // Compiled file the tables live in, NULL when they were built in memory
+    size_t mapping_length;
+} word_map;
+
+/**
+ * @brief Literal compiled for approximate matching with Myers' bit-parallel edit distance
+ *
+ * A match within k edits holds at least one of k + 1 disjoint pieces of the pattern unchanged,
+ * so the pieces serve as a prefilter.
+ */
+typedef struct
+{
+    size_t length;                          // Length of the pattern
+    size_t blocks;                          // 64-bit words per column of the distance matrix
+    int edits;                              // Most insertions, deletions and substitutions in a match
+    uint64_t *peq;                          // peq[c * blocks + b]: bits of block b where the pattern holds byte c
+    const char *text;                       // The pattern itself
+    size_t pieces[FUZZY_MAX_PIECES + 1];    // Piece i is text[pieces[i], pieces[i + 1])
+    size_t piece_count;                     // edits + 1, or 0 when that many pieces are too many to prefilter with
+} fuzzy_pattern;
+
+/**
+ * @brief One address of a -l range: a line number, or a marker the line must hold
+ */
+typedef struct
+{
+    long line;     // Line number, 0 when the address is a marker
+    char *marker;  // Text to look for, without its slashes or its '*'; NULL for a line number
+    size_t length; // Length of the marker
+    int kind;      // MARKER_LITERAL, or MARKER_PREFIX / MARKER_SUFFIX for a word wildcard
+} line_address;
+
+/**
+ * @brief Line range given to -l with at least one /marker/ address, as in sed
+ */
+typedef struct
+{
+    line_address start; // Opens a range; a marker opens one at every line holding it
+    line_address end;   // Closes the open range, on the line it addresses
+} address_range;
+
+/**
+ * @brief Progress of a scan through the ranges of an address range
+ */
+typedef struct
+{
+    const address_range *range;
+    int active;   // Whether the scan is inside a range
+    int first;    // Whether the scan is still on the line that opened the range
+    int done;     // Whether no range can open any more
+    int numbered; // Whether an address is a line number, so lines must be counted
+} range_cursor;
+
+/**
+ * @brief Search and replace settings shared by every line of a run
+ */
+typedef struct
+{
+    char *search;          // Text (or wildcard pattern) to look for
+    char *replace;         // Text to put in its place
+    int wildcard;          // Non-zero for -w prefix/suffix matching
+    long minimum;          // First line to modify
+    long maximum;          // Last line to modify
+    size_t search_length;  // strlen(search), set by compile_pattern()
+    size_t replace_length; // strlen(replace), set by compile_pattern()
+    replace_stats *stats;  // Counters to update, NULL when not collecting
+    int diff;              // DIFF_NONE, or the format of the changes-only output
+    const char *label;     // File name shown in diff headers
+    int whole_word;        // Non-zero to replace literal matches only when they form whole words
+    progress_counter *progress; // Live counters to update per chunk, NULL when not reporting
+    const rule_set *rules;      // Wildcard rules replacing search/replace, NULL for a single pattern
+    const char *cache;          // Result cache directory, NULL when not caching
+    uint64_t cache_spec;        // options_digest() of these options, set when caching
+    uint64_t max_count;         // Replacements after which the rest of the input is copied, 0 for no limit
+    int field;                  // CSV/TSV field the replacement is confined to, starting at 1; 0 for whole lines
+    char delimiter;             // Field delimiter when field is set
+    const fuzzy_pattern *fuzzy; // Approximate matching of the search text, NULL for exact matching
+    const word_map *map;        // Whole-word rename map replacing search/replace, NULL for a single pattern
+    const address_range *range; // -l range with a /marker/ address, NULL for a numeric range or none
+} replace_options;
+
+/**
+ * @brief State of a changes-only output being written
+ */
+typedef struct
+{
+    FILE *out;                         // Stream the diff is written to
+    int format;                        // DIFF_UNIFIED or DIFF_PATCH
+    const char *label;                 // File name shown in the headers
+    text_buffer context[DIFF_CONTEXT]; // Ring of the last unchanged lines
+    size_t context_first;              // Oldest line of the ring
+    size_t context_count;              // Lines held by the ring
+    text_buffer hunk;                  // Body of the hunk being built
+    text_buffer added;                 // '+' lines of the current run of changes
+    int hunk_open;                     // Whether a hunk is being built
+    int header_written;                // Whether the ---/+++ header was written
+    long old_start;                    // First input line of the hunk
+    long old_count;                    // Input lines covered by the hunk
+    long new_start;                    // First output line of the hunk
+    long new_count;                    // Output lines covered by the hunk
+    long delta;                        // Output lines minus input lines so far
+    int trailing;                      // Context lines still owed to the open hunk
+    long gap;                          // Unchanged lines since the last change
+} diff_writer;
+
+/**
+ * @brief What a --cache entry says about running some options over some input
+ */
+typedef struct
+{
+    uint32_t kind;          // CACHE_NO_MATCH or CACHE_MATCH
+    uint64_t content;       // FNV-1a of the input
+    uint64_t output_digest; // FNV-1a of the output, equal to content for CACHE_NO_MATCH
+    uint64_t output_length; // Length of the output
+} cache_result;
+
+/**
+ * @brief Sampled newline offsets of a file, persisted next to it as a .lidx sidecar
+ */
+typedef struct
+{
+    uint32_t stride;   // Number of lines between two samples
+    uint64_t size;     // Size of the indexed file in bytes
+    uint64_t lines;    // Total number of lines in the indexed file
+    uint64_t samples;  // Number of entries in offsets
+    uint64_t *offsets; // offsets[j] is the byte offset where line j * stride + 1 starts
+} line_index;
+
+int is_word_boundary(char c);
+const char *skip_non_word_characters(const char *start, const char *end);
+const char *skip_word(const char *start, const char *end);
+int compile_pattern(replace_options *options);
+void process_lines(FILE *fptr, FILE *optr, const replace_options *options, long first_line, off_t stop);
+int replace_line(const char *bfr, size_t length, const replace_options *options, uint64_t limit,
+                 text_buffer *output);
+uint64_t replacements_left(const replace_options *options, uint64_t made);
+uint64_t replace_span(const char *data, size_t length, const replace_options *options, long first_line,
+                      uint64_t limit, text_buffer *output);
+int run_plan(FILE *fptr, FILE *optr, const replace_options *options);
+FILE *open_in_place_output(const char *inputFile, char **tempFile);
+
+void diff_begin(diff_writer *diff, FILE *out, const replace_options *options);
+void diff_line(diff_writer *diff, long line, off_t offset, const char *old, size_t old_length,
+               const char *new, size_t new_length);
+void diff_end(diff_writer *diff);
+
+void start_stats(replace_stats *stats, const char *input);
+void print_stats(FILE *out, const replace_stats *stats);
+
+int start_progress(progress_counter *progress, uint64_t total, unsigned interval);
+void update_progress(progress_counter *progress, uint64_t bytes, uint64_t line, uint64_t matches);
+void stop_progress(progress_counter *progress);
+
+int classify_buffer(const unsigned char *data, size_t length);
+int sniff_file(int fd);
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length);
+int pwrite_all(int fd, const void *data, size_t length, off_t offset);
+int copy_range(int in_fd, off_t offset, off_t length, int out_fd);
+ssize_t read_lines(int fd, off_t position, off_t size, char **buffer, size_t *capacity);
+void buffer_reserve(text_buffer *buffer, size_t extra);
+void buffer_append(text_buffer *buffer, const char *data, size_t length);
+
+uint64_t byte_mask(const char *block, char byte);
+uint64_t count_newlines(const char *data, size_t length);
+const char *find_newline(const char *data, size_t length, uint64_t *remaining);
+off_t skip_lines(int fd, off_t start, uint64_t lines);
+
+size_t next_record(const char *data, size_t length, char delimiter);
+size_t complete_records(const char *data, size_t length, char delimiter);
+int field_replace(const char *record, size_t length, const replace_options *options, uint64_t limit,
+                  text_buffer *output);
+ssize_t join_record(FILE *fptr, char **bfr, size_t *capacity, ssize_t length);
+
+void compile_fuzzy(fuzzy_pattern *pattern, const char *text, size_t length, int edits);
+void free_fuzzy(fuzzy_pattern *pattern);
+int fuzzy_candidate(const fuzzy_pattern *pattern, const char *data, size_t length);
+int fuzzy_replace(const char *line, size_t length, const fuzzy_pattern *pattern, int whole_word, const char *with,
+                  size_t with_length, uint64_t limit, text_buffer *output);
+
+void init_map(word_map *map);
+int add_mapping(word_map *map, const char *key, const char *value);
+int load_map(word_map *map, const char *path);
+int build_map(word_map *map);
+int open_map(word_map *map, const char *path, const char *search, const char *replace);
+void free_map(word_map *map);
+int lookup_map(const word_map *map, const char *word, size_t length);
+int map_replace(const char *line, size_t length, const word_map *map, uint64_t limit, text_buffer *output);
+
+void init_rules(rule_set *rules);
+int add_rule(rule_set *rules, const char *pattern, const char *replacement);
+int load_rules(rule_set *rules, const char *path);
+int open_rules(rule_set *rules, const char *path, const char *search, const char *replace);
+void free_rules(rule_set *rules);
+int match_rules(const rule_set *rules, const char *word, size_t length);
+int rules_replace(const char *line, size_t length, const rule_set *rules, uint64_t limit, text_buffer *output);
+
+int load_compiled_rules(rule_set *rules, const char *path);
+int load_compiled_map(word_map *map, const char *path);
+int write_compiled_rules(const rule_set *rules, const char *path);
+int write_compiled_map(const word_map *map, const char *path);
+int run_compile(int argc, char *argv[]);
+
+int parse_range(char *text, address_range *range);
+void start_ranges(range_cursor *cursor, const address_range *range);
+const char *find_range_start(range_cursor *cursor, const char *data, const char *end, long *line);
+const char *find_range_end(range_cursor *cursor, const char *data, const char *end, long *line);
+int line_in_range(range_cursor *cursor, const char *line, size_t length, long number);
+
+int hash_file(int fd, uint64_t length, uint64_t *hash);
+uint64_t options_digest(const replace_options *options, int binaryMode);
+int cache_lookup(const replace_options *options, const char *filename, int fd, cache_result *result);
+void cache_store(const replace_options *options, const char *filename, int fd, const cache_result *result);
+void cache_finish(const replace_options *options, const char *filename, int fd, const char *outputFile,
+                  cache_result *result, uint64_t replacements);
+int cache_output_matches(const char *target, const cache_result *cached);
+
+int load_line_index(const char *filename, line_index *index);
+void free_line_index(line_index *index);
+long line_after(long maximum);
+off_t locate_line(int fd, const line_index *index, long line);
+
+int can_patch_in_place(const replace_options *options);
+int patch_in_place(const char *filename, const replace_options *options, int useIndex, int journal);
+
+int watch_and_replace(const char *inputFile, const char *outputFile, const replace_options *options, int binaryMode);
+
+int run_shard(const char *input, const char *outputDir, FILE *fragment, const replace_options *options,
+              long index, long count, int binaryMode);
+int merge_stats(int count, char *paths[], FILE *out);
+
+int run_daemon(const char *socketPath);
+int run_client(const char *socketPath, const replace_options *options, int binaryMode, const char *rulesFile,
+               const char *mapFile, long fuzzyEdits, const char *inputFile, const char *outputFile);
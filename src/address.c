@@ -0,0 +1,237 @@
+#include "hw5.h"
+
+/**
+ * @brief Parses one address of a -l range: a line number, or a marker between slashes
+ *
+ * A marker that is a single word with a '*' at one end matches words as -w does; any other
+ * marker is a literal the line must contain. Inside a marker, "\/" stands for a slash.
+ *
+ * @param text Start of the address; a marker is unescaped where it lies
+ * @param address Address to fill in
+ * @return char* First character after the address, NULL if it is invalid
+ */
+static char *parse_address(char *text, line_address *address)
+{
+    memset(address, 0, sizeof(*address));
+
+    if (*text != '/')
+    {
+        char *end;
+        long line = strtol(text, &end, 10);
+        if (end == text || line <= 0)
+            return NULL;
+        address->line = line;
+        return end;
+    }
+
+    char *marker = ++text;
+    char *copy = marker;
+    while (*text && *text != '/')
+    {
+        if (text[0] == '\\' && text[1] == '/')
+            text++;
+        *copy++ = *text++;
+    }
+    if (*text != '/')
+        return NULL;
+    text++;
+    *copy = '\0';
+
+    size_t length = copy - marker;
+    if (length == 0 || memchr(marker, '\n', length))
+        return NULL;
+
+    address->marker = marker;
+    address->length = length;
+    address->kind = MARKER_LITERAL;
+
+    int prefix = marker[length - 1] == '*';
+    int suffix = marker[0] == '*';
+    const char *affix = suffix ? marker + 1 : marker;
+    size_t affix_length = length - 1;
+    if (prefix != suffix && affix_length > 0 && skip_word(affix, affix + affix_length) == affix + affix_length)
+    {
+        address->marker = (char *)affix;
+        address->length = affix_length;
+        address->kind = prefix ? MARKER_PREFIX : MARKER_SUFFIX;
+    }
+    return text;
+}
+
+/**
+ * @brief Parses the argument of -l when it holds a /marker/ address, as in sed
+ *
+ * @param text "start,end", where each address is a line number or a /marker/; modified in place
+ * @param range Range to fill in, pointing into text
+ * @return int 0 on success, L_ARGUMENT_INVALID otherwise
+ */
+int parse_range(char *text, address_range *range)
+{
+    char *rest = parse_address(text, &range->start);
+    if (!rest || *rest != ',')
+        return L_ARGUMENT_INVALID;
+
+    rest = parse_address(rest + 1, &range->end);
+    if (!rest || *rest != '\0')
+        return L_ARGUMENT_INVALID;
+    return 0;
+}
+
+/**
+ * @brief Finds the first occurrence of a marker in a block of whole lines
+ *
+ * @param address Address holding a marker
+ * @param data Start of the block, the start of a line
+ * @param end End of the block
+ * @return const char* Occurrence, NULL if the block holds none
+ */
+static const char *find_marker(const line_address *address, const char *data, const char *end)
+{
+    const char *cursor = data;
+    const char *hit;
+
+    while ((hit = memmem(cursor, end - cursor, address->marker, address->length)) != NULL)
+    {
+        const char *after = hit + address->length;
+        if (address->kind == MARKER_LITERAL ||
+            (address->kind == MARKER_PREFIX && (hit == data || is_word_boundary(hit[-1]))) ||
+            (address->kind == MARKER_SUFFIX && (after == end || is_word_boundary(*after))))
+            return hit;
+        cursor = hit + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sets up the scan of an input through an address range
+ *
+ * @param cursor Cursor to initialize, outside any range
+ * @param range Parsed range
+ */
+void start_ranges(range_cursor *cursor, const address_range *range)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->range = range;
+    cursor->numbered = !range->start.marker || !range->end.marker;
+}
+
+/**
+ * @brief Finds the line a range starts at, outside any range
+ *
+ * A start marker opens a range at every line holding it; a line number opens one range only,
+ * after which the cursor is done.
+ *
+ * @param cursor Cursor, outside any range
+ * @param data Start of a block of whole lines
+ * @param end End of the block
+ * @param line Number of the line data starts at; advanced to the line returned, or past the
+ * block, when the cursor counts lines
+ * @return const char* Start of the line the range starts at, NULL if none starts in the block
+ */
+const char *find_range_start(range_cursor *cursor, const char *data, const char *end, long *line)
+{
+    const line_address *address = &cursor->range->start;
+    const char *start = NULL;
+
+    if (!address->marker)
+    {
+        if (*line > address->line)
+        {
+            cursor->done = 1;
+            return NULL;
+        }
+        uint64_t remaining = address->line - *line;
+        start = remaining ? find_newline(data, end - data, &remaining) : data;
+        *line = address->line - remaining;
+    }
+    else
+    {
+        const char *hit = find_marker(address, data, end);
+        if (hit)
+        {
+            start = memrchr(data, '\n', hit - data);
+            start = start ? start + 1 : data;
+        }
+        if (cursor->numbered)
+            *line += count_newlines(data, (start ? start : end) - data);
+    }
+
+    if (start == end)
+        return NULL; // The line starts with the next block
+    if (start)
+    {
+        cursor->active = 1;
+        cursor->first = 1;
+    }
+    return start;
+}
+
+/**
+ * @brief Finds where the current range ends
+ *
+ * An end marker is looked for from the line after the one that opened the range, and closes it
+ * on the line holding it. An end line number closes it on that line, or on its first line when
+ * that number is already passed.
+ *
+ * @param cursor Cursor, inside a range
+ * @param data Start of a block of whole lines, inside the range
+ * @param end End of the block
+ * @param line Number of the line data starts at; advanced past the range, or past the block,
+ * when the cursor counts lines
+ * @return const char* End of the range's last line, NULL if the range runs past the block
+ */
+const char *find_range_end(range_cursor *cursor, const char *data, const char *end, long *line)
+{
+    const line_address *address = &cursor->range->end;
+    const char *stop = NULL;
+
+    if (!address->marker)
+    {
+        long last = address->line > *line ? address->line : *line;
+        uint64_t remaining = last - *line + 1;
+        stop = find_newline(data, end - data, &remaining);
+        *line = last + 1 - remaining;
+    }
+    else
+    {
+        const char *from = data;
+        if (cursor->first)
+        {
+            from = memchr(data, '\n', end - data);
+            from = from ? from + 1 : end;
+        }
+
+        const char *hit = find_marker(address, from, end);
+        if (hit)
+        {
+            stop = memchr(hit, '\n', end - hit);
+            stop = stop ? stop + 1 : end;
+        }
+        if (cursor->numbered)
+            *line += count_newlines(data, (stop ? stop : end) - data);
+    }
+
+    cursor->first = 0;
+    if (stop)
+        cursor->active = 0;
+    return stop;
+}
+
+/**
+ * @brief Tells whether a line is inside a range, for runs that go line by line
+ *
+ * @param cursor Cursor, updated with the line
+ * @param line Line, with its newline
+ * @param length Length of the line
+ * @param number Number of the line
+ * @return int 1 if the line is inside a range, 0 otherwise
+ */
+int line_in_range(range_cursor *cursor, const char *line, size_t length, long number)
+{
+    const char *end = line + length;
+    if (!cursor->active && (cursor->done || !find_range_start(cursor, line, end, &number)))
+        return 0;
+
+    find_range_end(cursor, line, end, &number);
+    return 1;
+}
@@ -0,0 +1,356 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "HW5CACH"
+#define CACHE_VERSION 1
+
+/**
+ * @brief On-disk cache entry; the same record is filed under the input's path and its content
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;          // CACHE_NO_MATCH or CACHE_MATCH
+    uint64_t spec;          // Digest of the options the result was computed with
+    uint64_t size;          // Size of the input
+    int64_t mtime_sec;      // Modification time of the input
+    int64_t mtime_nsec;
+    uint64_t inode;         // Inode of the input
+    uint64_t content;       // FNV-1a of the input
+    uint64_t output_digest; // FNV-1a of the output
+    uint64_t output_length; // Length of the output
+    uint64_t checksum;      // FNV-1a of the record, checksum zeroed
+} cache_record;
+
+/**
+ * @brief Computes the checksum stored in a cache record
+ */
+static uint64_t record_checksum(cache_record record)
+{
+    record.checksum = 0;
+    return fnv1a(FNV_OFFSET_BASIS, &record, sizeof(record));
+}
+
+/**
+ * @brief Builds the path of a cache entry
+ *
+ * @param dir Cache directory
+ * @param prefix 'p' for entries filed by path, 'c' for entries filed by content
+ * @param key Key of the entry
+ * @return char* Newly allocated path, NULL on allocation failure
+ */
+static char *entry_path(const char *dir, char prefix, uint64_t key)
+{
+    size_t length = strlen(dir) + 20;
+    char *path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s/%c%016llx", dir, prefix, (unsigned long long)key);
+    return path;
+}
+
+/**
+ * @brief Key of the entry filed under the canonical path of an input
+ */
+static uint64_t path_key(const char *filename, uint64_t spec)
+{
+    char canonical[PATH_MAX];
+    const char *name = realpath(filename, canonical) ? canonical : filename;
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, name, strlen(name));
+    return fnv1a(hash, &spec, sizeof(spec));
+}
+
+/**
+ * @brief Key of the entry filed under the content of an input
+ */
+static uint64_t content_key(uint64_t content, uint64_t spec)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &content, sizeof(content));
+    return fnv1a(hash, &spec, sizeof(spec));
+}
+
+/**
+ * @brief Reads a cache entry and checks it was computed with the same options
+ *
+ * @return int 0 if a valid entry was read, -1 otherwise
+ */
+static int read_record(const char *dir, char prefix, uint64_t key, uint64_t spec, cache_record *record)
+{
+    char *path = entry_path(dir, prefix, key);
+    if (!path)
+        return -1;
+
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return -1;
+
+    ssize_t got = pread(fd, record, sizeof(*record), 0);
+    close(fd);
+
+    if (got != (ssize_t)sizeof(*record) ||
+        memcmp(record->magic, CACHE_MAGIC, sizeof(record->magic)) != 0 ||
+        record->version != CACHE_VERSION ||
+        record->spec != spec ||
+        record->checksum != record_checksum(*record))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a cache entry through a temporary file, so concurrent runs never see half of one
+ */
+static void write_record(const char *dir, char prefix, uint64_t key, const cache_record *record)
+{
+    char *path = entry_path(dir, prefix, key);
+    size_t length = strlen(dir) + sizeof("/.entry.XXXXXX");
+    char *temp = malloc(length);
+    if (!path || !temp)
+        goto done;
+    snprintf(temp, length, "%s/.entry.XXXXXX", dir);
+
+    // The cache is only an accelerator, so failing to save an entry is not an error
+    int fd = mkstemp(temp);
+    if (fd < 0)
+        goto done;
+
+    int ok = pwrite_all(fd, record, sizeof(*record), 0) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(temp, path) != 0)
+        unlink(temp);
+
+done:
+    free(path);
+    free(temp);
+}
+
+/**
+ * @brief Hashes the whole content of a file, without moving its file offset
+ *
+ * @param fd Descriptor of the file
+ * @param length Number of bytes to hash
+ * @param hash Receives the FNV-1a of the content
+ * @return int 0 on success, -1 on a read error
+ */
+int hash_file(int fd, uint64_t length, uint64_t *hash)
+{
+    char *buffer = malloc(COPY_CHUNK);
+    if (!buffer)
+        return -1;
+
+    uint64_t value = FNV_OFFSET_BASIS;
+    uint64_t offset = 0;
+    int result = 0;
+
+    while (offset < length)
+    {
+        ssize_t got = pread(fd, buffer, COPY_CHUNK, offset);
+        if (got <= 0)
+        {
+            result = got == 0 ? 0 : -1;
+            break;
+        }
+        value = fnv1a(value, buffer, got);
+        offset += got;
+    }
+
+    free(buffer);
+    *hash = value;
+    return result;
+}
+
+/**
+ * @brief Digests every option that changes the output of a run
+ *
+ * @param options Replacement options, before the line range is filled in from the file
+ * @param binaryMode What is done with binary inputs, as for --binary
+ * @return uint64_t Digest to key cache entries with
+ */
+uint64_t options_digest(const replace_options *options, int binaryMode)
+{
+    uint32_t version = CACHE_VERSION;
+    int64_t range[2] = {options->minimum, options->maximum};
+    int flags[3] = {options->wildcard, options->whole_word, binaryMode};
+
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &version, sizeof(version));
+    hash = fnv1a(hash, options->search, options->search_length + 1);
+    hash = fnv1a(hash, options->replace, options->replace_length + 1);
+    hash = fnv1a(hash, flags, sizeof(flags));
+    hash = fnv1a(hash, range, sizeof(range));
+    if (options->rules)
+        hash = fnv1a(hash, &options->rules->digest, sizeof(options->rules->digest));
+    if (options->map)
+        hash = fnv1a(hash, &options->map->digest, sizeof(options->map->digest));
+    if (options->max_count)
+        hash = fnv1a(hash, &options->max_count, sizeof(options->max_count));
+    if (options->fuzzy)
+        hash = fnv1a(hash, &options->fuzzy->edits, sizeof(options->fuzzy->edits));
+    if (options->range)
+    {
+        const line_address *addresses[2] = {&options->range->start, &options->range->end};
+        for (int i = 0; i < 2; i++)
+        {
+            hash = fnv1a(hash, &addresses[i]->line, sizeof(addresses[i]->line));
+            hash = fnv1a(hash, &addresses[i]->kind, sizeof(addresses[i]->kind));
+            if (addresses[i]->marker)
+                hash = fnv1a(hash, addresses[i]->marker, addresses[i]->length + 1);
+        }
+    }
+    if (options->field)
+    {
+        hash = fnv1a(hash, &options->field, sizeof(options->field));
+        hash = fnv1a(hash, &options->delimiter, sizeof(options->delimiter));
+    }
+    return hash;
+}
+
+/**
+ * @brief Looks up the result of running the options over a file
+ *
+ * The entry filed under the file's path is trusted when the file's size, modification time and
+ * inode are unchanged. Otherwise the file is hashed and the entry filed under its content is used.
+ *
+ * @param options Replacement options, with cache and cache_spec set
+ * @param filename Name of the input
+ * @param fd Descriptor of the input
+ * @param result Receives the cached result on a hit, and the content hash of the input on a miss
+ * @return int 1 on a hit, 0 on a miss, -1 if the input could not be hashed
+ */
+int cache_lookup(const replace_options *options, const char *filename, int fd, cache_result *result)
+{
+    struct stat st;
+    cache_record record;
+    memset(result, 0, sizeof(*result));
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+
+    uint64_t spec = options->cache_spec;
+    if (read_record(options->cache, 'p', path_key(filename, spec), spec, &record) == 0 &&
+        record.size == (uint64_t)st.st_size && record.inode == (uint64_t)st.st_ino &&
+        record.mtime_sec == st.st_mtim.tv_sec && record.mtime_nsec == st.st_mtim.tv_nsec)
+    {
+        result->kind = record.kind;
+        result->content = record.content;
+        result->output_digest = record.output_digest;
+        result->output_length = record.output_length;
+        return 1;
+    }
+
+    if (hash_file(fd, st.st_size, &result->content) != 0)
+        return -1;
+
+    if (read_record(options->cache, 'c', content_key(result->content, spec), spec, &record) != 0 ||
+        record.content != result->content || record.size != (uint64_t)st.st_size)
+        return 0;
+
+    result->kind = record.kind;
+    result->output_digest = record.output_digest;
+    result->output_length = record.output_length;
+
+    // Same content under a new timestamp: refresh the path entry so the next run skips the hash
+    cache_store(options, filename, fd, result);
+    return 1;
+}
+
+/**
+ * @brief Records the result of running the options over a file, under its path and its content
+ *
+ * @param options Replacement options, with cache and cache_spec set
+ * @param filename Name of the input
+ * @param fd Descriptor of the input
+ * @param result Result to record, with the content hash from cache_lookup()
+ */
+void cache_store(const replace_options *options, const char *filename, int fd, const cache_result *result)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return;
+
+    if (mkdir(options->cache, 0777) != 0 && errno != EEXIST)
+        return;
+
+    cache_record record = {0};
+    memcpy(record.magic, CACHE_MAGIC, sizeof(record.magic));
+    record.version = CACHE_VERSION;
+    record.kind = result->kind;
+    record.spec = options->cache_spec;
+    record.size = st.st_size;
+    record.mtime_sec = st.st_mtim.tv_sec;
+    record.mtime_nsec = st.st_mtim.tv_nsec;
+    record.inode = st.st_ino;
+    record.content = result->content;
+    record.output_digest = result->output_digest;
+    record.output_length = result->output_length;
+    record.checksum = record_checksum(record);
+
+    write_record(options->cache, 'p', path_key(filename, record.spec), &record);
+    write_record(options->cache, 'c', content_key(record.content, record.spec), &record);
+}
+
+/**
+ * @brief Checks whether a file already holds the output a cache entry describes
+ *
+ * @param target File to check
+ * @param cached Cache entry
+ * @return int 1 if the file has the length and digest of the entry's output, 0 otherwise
+ */
+int cache_output_matches(const char *target, const cache_result *cached)
+{
+    int fd = open(target, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    uint64_t digest;
+    int matches = fstat(fd, &st) == 0 && (uint64_t)st.st_size == cached->output_length &&
+                  hash_file(fd, st.st_size, &digest) == 0 && digest == cached->output_digest;
+    close(fd);
+    return matches;
+}
+
+/**
+ * @brief Completes the result of a finished run over a file and records it
+ *
+ * @param options Replacement options, with cache and cache_spec set
+ * @param filename Name of the input
+ * @param fd Descriptor of the input, which must still hold the content that was processed
+ * @param outputFile File holding the output, hashed when the run replaced something
+ * @param result Result filled in by cache_lookup(), completed here
+ * @param replacements Number of replacements the run made
+ */
+void cache_finish(const replace_options *options, const char *filename, int fd, const char *outputFile,
+                  cache_result *result, uint64_t replacements)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return;
+
+    if (replacements == 0)
+    {
+        result->kind = CACHE_NO_MATCH;
+        result->output_digest = result->content;
+        result->output_length = st.st_size;
+    }
+    else
+    {
+        int out = open(outputFile, O_RDONLY);
+        struct stat out_st;
+        if (out < 0)
+            return;
+        int ok = fstat(out, &out_st) == 0 && hash_file(out, out_st.st_size, &result->output_digest) == 0;
+        close(out);
+        if (!ok)
+            return;
+        result->kind = CACHE_MATCH;
+        result->output_length = out_st.st_size;
+    }
+
+    cache_store(options, filename, fd, result);
+}
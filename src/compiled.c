@@ -0,0 +1,318 @@
+#include "hw5.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COMPILED_MAGIC "HW5PATS"
+#define COMPILED_VERSION 1
+#define COMPILED_RULES 1
+#define COMPILED_MAP 2
+#define COMPILED_SECTIONS 4
+#define BYTE_ORDER_MARK 0x01020304u
+
+/**
+ * @brief Header of a compiled rule set or word map, followed by its arrays
+ *
+ * Every array is stored as it is laid out in memory and refers to the others by index or offset
+ * only, so a run maps the file and uses the arrays where they lie.
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;                        // COMPILED_RULES or COMPILED_MAP
+    uint32_t byte_order;                  // BYTE_ORDER_MARK as the writer stored it
+    uint32_t word_size;                   // sizeof(size_t) of the writer
+    uint64_t digest;                      // Digest of the rules or the map, as --cache keys it
+    uint64_t counts[COMPILED_SECTIONS];   // Kind-specific counts
+    uint64_t offsets[COMPILED_SECTIONS];  // Offset of each array, a multiple of 8
+    uint64_t lengths[COMPILED_SECTIONS];  // Length of each array in bytes
+    uint64_t checksum;                    // FNV-1a of the header, checksum zeroed
+} compiled_header;
+
+/**
+ * @brief Computes the checksum stored in a header
+ */
+static uint64_t header_checksum(compiled_header header)
+{
+    header.checksum = 0;
+    return fnv1a(FNV_OFFSET_BASIS, &header, sizeof(header));
+}
+
+/**
+ * @brief Writes a header and its arrays through a temporary file, so no run maps half of one
+ *
+ * @param path Path of the compiled file
+ * @param header Header with kind, digest, counts and lengths set; completed here
+ * @param sections Data of each array
+ * @return int 0 on success, OUTPUT_FILE_UNWRITABLE otherwise
+ */
+static int write_compiled(const char *path, compiled_header *header, const void *sections[COMPILED_SECTIONS])
+{
+    memcpy(header->magic, COMPILED_MAGIC, sizeof(header->magic));
+    header->version = COMPILED_VERSION;
+    header->byte_order = BYTE_ORDER_MARK;
+    header->word_size = sizeof(size_t);
+
+    uint64_t offset = sizeof(*header);
+    for (int i = 0; i < COMPILED_SECTIONS; i++)
+    {
+        header->offsets[i] = offset;
+        offset = (offset + header->lengths[i] + 7) & ~7ULL;
+    }
+    header->checksum = header_checksum(*header);
+
+    size_t length = strlen(path) + sizeof(".XXXXXX");
+    char *temp = malloc(length);
+    if (!temp)
+        return OUTPUT_FILE_UNWRITABLE;
+    snprintf(temp, length, "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp);
+    if (fd < 0)
+    {
+        free(temp);
+        return OUTPUT_FILE_UNWRITABLE;
+    }
+
+    int ok = pwrite_all(fd, header, sizeof(*header), 0) == 0;
+    for (int i = 0; ok && i < COMPILED_SECTIONS; i++)
+        ok = header->lengths[i] == 0 || pwrite_all(fd, sections[i], header->lengths[i], header->offsets[i]) == 0;
+    ok = ok && ftruncate(fd, offset) == 0 && fchmod(fd, 0644) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(temp, path) != 0)
+    {
+        unlink(temp);
+        ok = 0;
+    }
+
+    free(temp);
+    return ok ? 0 : OUTPUT_FILE_UNWRITABLE;
+}
+
+/**
+ * @brief Maps a compiled file and checks its header
+ *
+ * Only the header is read, so mapping a file costs the same whatever it holds.
+ *
+ * @param path Path of the file
+ * @param kind COMPILED_RULES or COMPILED_MAP
+ * @param mapping Receives the mapping
+ * @param length Receives the length of the mapping
+ * @return int 0 on success, -1 if the file is not a compiled file, INPUT_FILE_MISSING if it cannot
+ * be read, WILDCARD_INVALID if it is a compiled file this build cannot use
+ */
+static int map_compiled(const char *path, uint32_t kind, const compiled_header **mapping, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return INPUT_FILE_MISSING;
+
+    struct stat st;
+    char magic[8];
+    if (fstat(fd, &st) != 0 || pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, COMPILED_MAGIC, sizeof(magic)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(compiled_header))
+    {
+        close(fd);
+        return WILDCARD_INVALID;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return INPUT_FILE_MISSING;
+
+    const compiled_header *header = data;
+    int valid = header->version == COMPILED_VERSION && header->kind == kind &&
+                header->byte_order == BYTE_ORDER_MARK && header->word_size == sizeof(size_t) &&
+                header->checksum == header_checksum(*header);
+    for (int i = 0; valid && i < COMPILED_SECTIONS; i++)
+        valid = header->offsets[i] % 8 == 0 && header->offsets[i] <= (uint64_t)st.st_size &&
+                header->lengths[i] <= (uint64_t)st.st_size - header->offsets[i];
+
+    if (!valid)
+    {
+        munmap(data, st.st_size);
+        return WILDCARD_INVALID;
+    }
+
+    *mapping = header;
+    *length = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Uses a rule set compiled by write_compiled_rules() in place
+ *
+ * @param rules Rule set, initialized and empty; released with free_rules()
+ * @param path Path of the file
+ * @return int 0 on success, -1 if the file is not a compiled file, INPUT_FILE_MISSING if it cannot
+ * be read, WILDCARD_INVALID if it cannot be used
+ */
+int load_compiled_rules(rule_set *rules, const char *path)
+{
+    const compiled_header *header;
+    size_t length;
+    int status = map_compiled(path, COMPILED_RULES, &header, &length);
+    if (status != 0)
+        return status;
+
+    // The tries always hold their root
+    const char *base = (const char *)header;
+    if (header->lengths[0] != header->counts[0] * sizeof(wildcard_rule) ||
+        header->lengths[1] != header->counts[1] * sizeof(trie_node) ||
+        header->lengths[2] != header->counts[2] * sizeof(trie_node) || header->counts[1] == 0 ||
+        header->counts[2] == 0)
+    {
+        munmap((void *)base, length);
+        return WILDCARD_INVALID;
+    }
+
+    free_rules(rules);
+    memset(rules, 0, sizeof(*rules));
+    rules->rules = (wildcard_rule *)(base + header->offsets[0]);
+    rules->count = rules->capacity = header->counts[0];
+    rules->prefixes = (trie_node *)(base + header->offsets[1]);
+    rules->prefix_count = rules->prefix_capacity = header->counts[1];
+    rules->suffixes = (trie_node *)(base + header->offsets[2]);
+    rules->suffix_count = rules->suffix_capacity = header->counts[2];
+    rules->strings.data = (char *)(base + header->offsets[3]);
+    rules->strings.length = header->lengths[3];
+    rules->digest = header->digest;
+    rules->mapping = (void *)base;
+    rules->mapping_length = length;
+    return 0;
+}
+
+/**
+ * @brief Uses a word map compiled by write_compiled_map() in place
+ *
+ * @param map Word map, initialized and empty; released with free_map()
+ * @param path Path of the file
+ * @return int 0 on success, -1 if the file is not a compiled file, INPUT_FILE_MISSING if it cannot
+ * be read, WILDCARD_INVALID if it cannot be used
+ */
+int load_compiled_map(word_map *map, const char *path)
+{
+    const compiled_header *header;
+    size_t length;
+    int status = map_compiled(path, COMPILED_MAP, &header, &length);
+    if (status != 0)
+        return status;
+
+    const char *base = (const char *)header;
+    if (header->lengths[0] != header->counts[0] * sizeof(map_entry) ||
+        header->lengths[1] != header->counts[0] * sizeof(int32_t) ||
+        header->lengths[2] != header->counts[1] * sizeof(uint64_t) || header->counts[1] > header->counts[0])
+    {
+        munmap((void *)base, length);
+        return WILDCARD_INVALID;
+    }
+
+    free_map(map);
+    memset(map, 0, sizeof(*map));
+    map->entries = (map_entry *)(base + header->offsets[0]);
+    map->count = map->capacity = header->counts[0];
+    map->seeds = (int32_t *)(base + header->offsets[1]);
+    map->slots = (uint64_t *)(base + header->offsets[2]);
+    map->slot_count = header->counts[1];
+    map->strings.data = (char *)(base + header->offsets[3]);
+    map->strings.length = header->lengths[3];
+    map->shortest = header->counts[2];
+    map->longest = header->counts[3];
+    map->digest = header->digest;
+    map->mapping = (void *)base;
+    map->mapping_length = length;
+    return 0;
+}
+
+/**
+ * @brief Saves a rule set so later runs can map it instead of parsing and building its tries
+ *
+ * @return int 0 on success, OUTPUT_FILE_UNWRITABLE otherwise
+ */
+int write_compiled_rules(const rule_set *rules, const char *path)
+{
+    compiled_header header = {0};
+    header.kind = COMPILED_RULES;
+    header.digest = rules->digest;
+    header.counts[0] = rules->count;
+    header.counts[1] = rules->prefix_count;
+    header.counts[2] = rules->suffix_count;
+    header.lengths[0] = rules->count * sizeof(wildcard_rule);
+    header.lengths[1] = rules->prefix_count * sizeof(trie_node);
+    header.lengths[2] = rules->suffix_count * sizeof(trie_node);
+    header.lengths[3] = rules->strings.length;
+
+    const void *sections[COMPILED_SECTIONS] = {rules->rules, rules->prefixes, rules->suffixes, rules->strings.data};
+    return write_compiled(path, &header, sections);
+}
+
+/**
+ * @brief Saves a built word map so later runs can map it instead of parsing it and building its hash
+ *
+ * @return int 0 on success, OUTPUT_FILE_UNWRITABLE otherwise
+ */
+int write_compiled_map(const word_map *map, const char *path)
+{
+    compiled_header header = {0};
+    header.kind = COMPILED_MAP;
+    header.digest = map->digest;
+    header.counts[0] = map->count;
+    header.counts[1] = map->slot_count;
+    header.counts[2] = map->shortest;
+    header.counts[3] = map->longest;
+    header.lengths[0] = map->count * sizeof(map_entry);
+    header.lengths[1] = map->seeds ? map->count * sizeof(int32_t) : 0;
+    header.lengths[2] = map->slot_count * sizeof(uint64_t);
+    header.lengths[3] = map->strings.length;
+
+    const void *sections[COMPILED_SECTIONS] = {map->entries, map->seeds, map->slots, map->strings.data};
+    return write_compiled(path, &header, sections);
+}
+
+/**
+ * @brief Runs the compile subcommand: "compile --rules FILE OUTPUT" or "compile --map FILE OUTPUT"
+ *
+ * @param argc Number of arguments after "compile"
+ * @param argv Arguments after "compile"
+ * @return int Exit status
+ */
+int run_compile(int argc, char *argv[])
+{
+    if (argc != 3)
+        return MISSING_ARGUMENT;
+
+    int status;
+    if (strcmp(argv[0], "--rules") == 0)
+    {
+        rule_set rules;
+        init_rules(&rules);
+        status = load_rules(&rules, argv[1]);
+        if (status == 0)
+            status = write_compiled_rules(&rules, argv[2]);
+        free_rules(&rules);
+    }
+    else if (strcmp(argv[0], "--map") == 0)
+    {
+        word_map map;
+        init_map(&map);
+        status = load_map(&map, argv[1]);
+        if (status == 0)
+            status = build_map(&map);
+        if (status == 0)
+            status = write_compiled_map(&map, argv[2]);
+        free_map(&map);
+    }
+    else
+    {
+        status = MISSING_ARGUMENT;
+    }
+    return status;
+}
@@ -0,0 +1,922 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define DAEMON_MAGIC 0x48573544u // "HW5D"
+#define DAEMON_QUEUE_SIZE 128
+#define DAEMON_MAX_CONNECTIONS 1024
+#define DAEMON_IDLE_SECONDS 30  // Idle connections are closed after this long
+#define DAEMON_READ_SECONDS 5   // A request must arrive whole within this long once it has started
+#define DAEMON_MAX_TEXT (1u << 20)
+#define DAEMON_MAX_BUFFER (1u << 26)
+#define DAEMON_PATTERNS 16 // Rule sets, word maps and fuzzy patterns kept compiled between requests
+
+#define REQUEST_WILDCARD 0x1
+#define REQUEST_BUFFER 0x2
+#define REQUEST_WORD 0x4
+#define REQUEST_BINARY_SKIP 0x8
+#define REQUEST_BINARY_TEXT 0x10
+#define REQUEST_RULES 0x20 // The table path names a --rules file
+#define REQUEST_MAP 0x40   // The table path names a --map file
+#define REQUEST_PAIR 0x80  // -s and -r were given, which a --rules or --map run may go without
+
+/**
+ * @brief Header of a request frame, followed by the search text, the replacement text, the table
+ * path, then either the input and output paths or the input buffer
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flags;          // REQUEST_* bits
+    int64_t minimum;         // First line to modify
+    int64_t maximum;         // Last line to modify
+    uint32_t search_length;  // Length of the search text
+    uint32_t replace_length; // Length of the replacement text
+    uint32_t table_length;   // Length of the --rules or --map path, 0 without one
+    uint32_t edits;          // --fuzzy edits, 0 for exact matching
+    uint64_t input_length;   // Length of the input path, or of the buffer in buffer mode
+    uint64_t output_length;  // Length of the output path, 0 in buffer mode
+} daemon_request;
+
+/**
+ * @brief Rule set, word map or fuzzy pattern compiled for one request and kept for the next ones
+ */
+typedef struct
+{
+    uint64_t key;        // pattern_key() of the requests it serves
+    uint64_t used;       // pattern_clock at its last use, the least recent being evicted first
+    int users;           // Requests using it now; only an unused pattern is evicted or freed
+    int cached;          // Whether it is in the patterns table
+    uint32_t kind;       // REQUEST_RULES, REQUEST_MAP, or 0 for a fuzzy pattern
+    rule_set rules;
+    word_map map;
+    fuzzy_pattern fuzzy;
+    char *text;          // Search text the fuzzy pattern points into
+} daemon_pattern;
+
+/**
+ * @brief Header of a response frame, followed by `length` bytes of output in buffer mode
+ */
+typedef struct
+{
+    int32_t status; // Exit status the local run would have had
+    uint32_t reserved;
+    uint64_t length;
+} daemon_response;
+
+static int queue[DAEMON_QUEUE_SIZE];
+static size_t queue_head = 0;
+static size_t queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+
+// Workers hand each connection back to the accept loop through this pipe, or -1 once they closed it
+static int returns[2] = {-1, -1};
+
+static daemon_pattern *patterns[DAEMON_PATTERNS];
+static uint64_t pattern_clock = 0;
+static pthread_mutex_t pattern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t stop_daemon = 0;
+
+/**
+ * @brief Signal handler ending the accept loop
+ */
+static void handle_stop(int signum)
+{
+    (void)signum;
+    stop_daemon = 1;
+}
+
+/**
+ * @brief Reads exactly length bytes from a socket
+ *
+ * @return int 0 on success, -1 on error or end of stream
+ */
+static int read_all(int fd, void *data, size_t length)
+{
+    char *bytes = data;
+    while (length > 0)
+    {
+        ssize_t got = read(fd, bytes, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        bytes += got;
+        length -= got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes exactly length bytes to a socket
+ *
+ * @return int 0 on success, -1 on error
+ */
+static int write_all(int fd, const void *data, size_t length)
+{
+    const char *bytes = data;
+    while (length > 0)
+    {
+        ssize_t put = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put < 0)
+            return -1;
+        bytes += put;
+        length -= put;
+    }
+    return 0;
+}
+
+/**
+ * @brief Digest of what a compiled pattern is built from
+ *
+ * A --rules or --map file is known by its device, inode, size and modification time, so a request
+ * costs a stat() rather than a read of the file, and an edited file gets a new key.
+ *
+ * @param request Request header
+ * @param search Search text of the request
+ * @param replace Replacement text of the request
+ * @param table Status of the --rules or --map file, NULL for a fuzzy pattern
+ * @return uint64_t Key of the pattern
+ */
+static uint64_t pattern_key(const daemon_request *request, const char *search, const char *replace,
+                            const struct stat *table)
+{
+    uint64_t fields[8] = {request->flags & (REQUEST_RULES | REQUEST_MAP | REQUEST_PAIR), request->edits,
+                          request->search_length, request->replace_length};
+    if (table)
+    {
+        fields[4] = table->st_dev;
+        fields[5] = table->st_ino;
+        fields[6] = table->st_size;
+        fields[7] = (uint64_t)table->st_mtim.tv_sec * 1000000000u + table->st_mtim.tv_nsec;
+    }
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, fields, sizeof(fields));
+    hash = fnv1a(hash, search, request->search_length);
+    return fnv1a(hash, replace, request->replace_length);
+}
+
+/**
+ * @brief Frees a pattern no request uses any more
+ */
+static void drop_pattern(daemon_pattern *pattern)
+{
+    if (pattern->kind == REQUEST_RULES)
+        free_rules(&pattern->rules);
+    else if (pattern->kind == REQUEST_MAP)
+        free_map(&pattern->map);
+    else
+        free_fuzzy(&pattern->fuzzy);
+    free(pattern->text);
+    free(pattern);
+}
+
+/**
+ * @brief Puts a newly compiled pattern in the table, in a free slot or in place of the least recently
+ * used pattern no request holds; a pattern that finds no slot is freed after its request
+ *
+ * Must be called with pattern_lock held.
+ */
+static void cache_pattern(daemon_pattern *pattern)
+{
+    size_t victim = DAEMON_PATTERNS;
+    for (size_t i = 0; i < DAEMON_PATTERNS; i++)
+    {
+        if (!patterns[i])
+        {
+            victim = i;
+            break;
+        }
+        if (patterns[i]->users == 0 && (victim == DAEMON_PATTERNS || patterns[i]->used < patterns[victim]->used))
+            victim = i;
+    }
+    if (victim == DAEMON_PATTERNS)
+        return;
+
+    if (patterns[victim])
+        drop_pattern(patterns[victim]);
+    patterns[victim] = pattern;
+    pattern->cached = 1;
+}
+
+/**
+ * @brief Finds the compiled rule set, word map or fuzzy pattern of a request, compiling it on a miss
+ *
+ * Compiling happens outside the lock, so a slow map build does not hold up other requests. When two
+ * requests compile the same pattern at once, the first one cached is kept.
+ *
+ * @param request Request header, for a --rules, --map or --fuzzy run
+ * @param search Search text of the request
+ * @param replace Replacement text of the request
+ * @param table Path of the --rules or --map file
+ * @param found Receives the pattern, to hand back with release_pattern()
+ * @return int 0 on success, the exit status a local run would have had, -1 on allocation failure
+ */
+static int acquire_pattern(const daemon_request *request, const char *search, const char *replace,
+                           const char *table, daemon_pattern **found)
+{
+    uint32_t kind = request->flags & (REQUEST_RULES | REQUEST_MAP);
+    int pair = (request->flags & REQUEST_PAIR) != 0;
+    struct stat before;
+    if (kind && stat(table, &before) != 0)
+        return INPUT_FILE_MISSING;
+    uint64_t key = pattern_key(request, search, replace, kind ? &before : NULL);
+
+    pthread_mutex_lock(&pattern_lock);
+    for (size_t i = 0; i < DAEMON_PATTERNS; i++)
+    {
+        if (patterns[i] && patterns[i]->key == key)
+        {
+            patterns[i]->users++;
+            patterns[i]->used = ++pattern_clock;
+            *found = patterns[i];
+            pthread_mutex_unlock(&pattern_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&pattern_lock);
+
+    daemon_pattern *pattern = calloc(1, sizeof(*pattern));
+    if (!pattern)
+        return -1;
+    pattern->key = key;
+    pattern->kind = kind;
+    pattern->users = 1;
+
+    int status = 0;
+    if (kind == REQUEST_RULES)
+        status = open_rules(&pattern->rules, table, pair ? search : NULL, pair ? replace : NULL);
+    else if (kind == REQUEST_MAP)
+        status = open_map(&pattern->map, table, pair ? search : NULL, pair ? replace : NULL);
+    else if ((pattern->text = strdup(search)) != NULL)
+        compile_fuzzy(&pattern->fuzzy, pattern->text, request->search_length, (int)request->edits);
+    else
+        status = -1;
+
+    if (status != 0)
+    {
+        drop_pattern(pattern);
+        return status;
+    }
+
+    // A file written while it was loaded may not match the key taken before, so it is not kept
+    struct stat after;
+    int keep = !kind || (stat(table, &after) == 0 && pattern_key(request, search, replace, &after) == key);
+
+    pthread_mutex_lock(&pattern_lock);
+    pattern->used = ++pattern_clock;
+    for (size_t i = 0; keep && i < DAEMON_PATTERNS; i++)
+    {
+        if (patterns[i] && patterns[i]->key == key)
+        {
+            drop_pattern(pattern);
+            pattern = patterns[i];
+            pattern->users++;
+            pattern->used = pattern_clock;
+            keep = 0;
+        }
+    }
+    if (keep)
+        cache_pattern(pattern);
+    pthread_mutex_unlock(&pattern_lock);
+
+    *found = pattern;
+    return 0;
+}
+
+/**
+ * @brief Hands back a pattern from acquire_pattern(), freeing it if it is not cached
+ */
+static void release_pattern(daemon_pattern *pattern)
+{
+    if (!pattern)
+        return;
+    pthread_mutex_lock(&pattern_lock);
+    int drop = --pattern->users == 0 && !pattern->cached;
+    pthread_mutex_unlock(&pattern_lock);
+    if (drop)
+        drop_pattern(pattern);
+}
+
+/**
+ * @brief Frees every cached pattern, once the workers have stopped
+ */
+static void free_patterns(void)
+{
+    for (size_t i = 0; i < DAEMON_PATTERNS; i++)
+    {
+        if (patterns[i])
+            drop_pattern(patterns[i]);
+        patterns[i] = NULL;
+    }
+}
+
+/**
+ * @brief Sets up the options of a request, as a local run would from the same arguments
+ *
+ * Plain patterns cost nothing to compile and are set up every time; rule sets, word maps and fuzzy
+ * patterns come from the table of compiled patterns.
+ *
+ * @param request Request header
+ * @param search Search text of the request
+ * @param replace Replacement text of the request
+ * @param table Path of the --rules or --map file, empty without one
+ * @param options Receives the compiled options
+ * @param pattern Receives the compiled pattern the options use, NULL if none; handed back with
+ * release_pattern()
+ * @return int 0 on success, the exit status a local run would have had, -1 on allocation failure
+ */
+static int start_request(const daemon_request *request, char *search, char *replace, const char *table,
+                         replace_options *options, daemon_pattern **pattern)
+{
+    memset(options, 0, sizeof(*options));
+    options->search = search;
+    options->replace = replace;
+    options->wildcard = (request->flags & REQUEST_WILDCARD) != 0;
+    options->whole_word = (request->flags & REQUEST_WORD) != 0;
+    options->minimum = request->minimum;
+    options->maximum = request->maximum;
+    *pattern = NULL;
+
+    if (request->flags & (REQUEST_RULES | REQUEST_MAP))
+    {
+        // Rules are wildcards and map entries literal words, whatever -w says
+        options->wildcard = (request->flags & REQUEST_RULES) != 0;
+    }
+    else
+    {
+        int status = compile_pattern(options);
+        if (status != 0 || request->edits == 0)
+            return status;
+        if (options->wildcard || request->edits >= options->search_length)
+            return MISSING_ARGUMENT;
+    }
+
+    int status = acquire_pattern(request, search, replace, table, pattern);
+    if (status != 0)
+        return status;
+
+    if ((*pattern)->kind == REQUEST_RULES)
+        options->rules = &(*pattern)->rules;
+    else if ((*pattern)->kind == REQUEST_MAP)
+        options->map = &(*pattern)->map;
+    else
+        options->fuzzy = &(*pattern)->fuzzy;
+    return 0;
+}
+
+/**
+ * @brief Serves one request frame, mirroring the exit statuses and the --binary handling of a local run
+ *
+ * @param fd Client socket
+ * @return int 0 to keep the connection open, -1 to close it
+ */
+static int serve_request(int fd)
+{
+    daemon_request request;
+    if (read_all(fd, &request, sizeof(request)) != 0 || request.magic != DAEMON_MAGIC ||
+        request.search_length > DAEMON_MAX_TEXT || request.replace_length > DAEMON_MAX_TEXT ||
+        request.table_length > DAEMON_MAX_TEXT ||
+        request.input_length > DAEMON_MAX_BUFFER || request.output_length > DAEMON_MAX_TEXT ||
+        ((request.flags & REQUEST_BUFFER) == 0 && request.input_length > DAEMON_MAX_TEXT))
+    {
+        return -1;
+    }
+
+    char *search = malloc(request.search_length + 1);
+    char *replace = malloc(request.replace_length + 1);
+    char *table = malloc(request.table_length + 1);
+    char *input = malloc(request.input_length + 1);
+    char *output = malloc(request.output_length + 1);
+    char *result = NULL;
+    daemon_pattern *pattern = NULL;
+    int keep = -1;
+
+    if (!search || !replace || !table || !input || !output ||
+        read_all(fd, search, request.search_length) != 0 ||
+        read_all(fd, replace, request.replace_length) != 0 ||
+        read_all(fd, table, request.table_length) != 0 ||
+        read_all(fd, input, request.input_length) != 0 ||
+        read_all(fd, output, request.output_length) != 0)
+    {
+        goto done;
+    }
+    search[request.search_length] = '\0';
+    replace[request.replace_length] = '\0';
+    table[request.table_length] = '\0';
+    input[request.input_length] = '\0';
+    output[request.output_length] = '\0';
+
+    daemon_response response = {0, 0, 0};
+    const char *reply = NULL;
+    replace_options options;
+    int sniff = (request.flags & REQUEST_BINARY_TEXT) == 0;
+
+    if (request.flags & REQUEST_BUFFER)
+    {
+        // The request buffer is scanned where it lies, without a stream over it
+        size_t sniffed = request.input_length < SNIFF_SIZE ? request.input_length : SNIFF_SIZE;
+        int binary = sniff && classify_buffer((const unsigned char *)input, sniffed) == FILE_BINARY;
+        text_buffer replaced = {NULL, 0, 0};
+
+        if ((response.status = start_request(&request, search, replace, table, &options, &pattern)) == 0)
+        {
+            if (binary && (request.flags & REQUEST_BINARY_SKIP) == 0)
+            {
+                reply = input;
+                response.length = request.input_length;
+            }
+            else if (!binary)
+            {
+                replace_span(input, request.input_length, &options, 1, UINT64_MAX, &replaced);
+                reply = result = replaced.data;
+                response.length = replaced.length;
+            }
+        }
+    }
+    else
+    {
+        FILE *fptr = fopen(input, "r");
+        FILE *optr = NULL;
+        int binary = fptr && sniff && sniff_file(fileno(fptr)) == FILE_BINARY;
+
+        // The options are set up before the output is opened, as in a local run, and a skipped binary
+        // leaves the output as it was
+        if (fptr == NULL)
+            response.status = INPUT_FILE_MISSING;
+        else
+            response.status = start_request(&request, search, replace, table, &options, &pattern);
+
+        if (response.status == 0 && !(binary && (request.flags & REQUEST_BINARY_SKIP)))
+        {
+            struct stat st;
+            if ((optr = fopen(output, "w")) == NULL)
+                response.status = OUTPUT_FILE_UNWRITABLE;
+            else if (!binary)
+                process_lines(fptr, optr, &options, 1, -1);
+            else if (fstat(fileno(fptr), &st) != 0 || copy_range(fileno(fptr), 0, st.st_size, fileno(optr)) != 0)
+                response.status = OUTPUT_FILE_UNWRITABLE;
+        }
+
+        if (fptr)
+            fclose(fptr);
+        if (optr && fclose(optr) != 0 && response.status == 0)
+            response.status = OUTPUT_FILE_UNWRITABLE;
+    }
+
+    // A request the daemon could not allocate for is left to a local run
+    if (response.status >= 0 && write_all(fd, &response, sizeof(response)) == 0 &&
+        write_all(fd, reply, response.length) == 0)
+    {
+        keep = 0;
+    }
+
+done:
+    release_pattern(pattern);
+    free(search);
+    free(replace);
+    free(table);
+    free(input);
+    free(output);
+    free(result);
+    return keep;
+}
+
+/**
+ * @brief Worker thread serving one request at a time from the connections the accept loop hands over
+ *
+ * After each request the connection goes back to the accept loop, which waits for its next
+ * request, so a client keeping its connection open does not hold on to a worker.
+ */
+static void *worker(void *unused)
+{
+    (void)unused;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == 0)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        int fd = queue[queue_head];
+        queue_head = (queue_head + 1) % DAEMON_QUEUE_SIZE;
+        queue_count--;
+        pthread_cond_signal(&queue_space);
+        pthread_mutex_unlock(&queue_lock);
+
+        if (fd < 0)
+            return NULL; // Shutdown marker
+
+        if (serve_request(fd) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        while (write(returns[1], &fd, sizeof(fd)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/**
+ * @brief Hands a connection with a request waiting (or a -1 shutdown marker) to the worker threads
+ */
+static void enqueue(int fd)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == DAEMON_QUEUE_SIZE)
+        pthread_cond_wait(&queue_space, &queue_lock);
+    queue[(queue_head + queue_count) % DAEMON_QUEUE_SIZE] = fd;
+    queue_count++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief Fills a Unix socket address
+ *
+ * @return int 0 on success, -1 if the path is too long
+ */
+static int socket_address(const char *path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+        return -1;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/**
+ * @brief Connections waiting for their next request, polled by the accept loop
+ */
+typedef struct
+{
+    struct pollfd polls[DAEMON_MAX_CONNECTIONS + 2]; // The listener, the return pipe, then the idle connections
+    time_t since[DAEMON_MAX_CONNECTIONS + 2];        // When each connection became idle
+    size_t count;                                    // Idle connections
+    size_t open;                                     // Connections accepted and not closed yet
+} idle_set;
+
+/**
+ * @brief Adds a connection to the idle set
+ */
+static void add_idle(idle_set *idle, int fd, time_t now)
+{
+    size_t slot = idle->count++ + 2;
+    idle->polls[slot].fd = fd;
+    idle->polls[slot].events = POLLIN;
+    idle->polls[slot].revents = 0;
+    idle->since[slot] = now;
+}
+
+/**
+ * @brief Removes a connection from the idle set, moving the last one into its slot
+ */
+static void remove_idle(idle_set *idle, size_t slot)
+{
+    size_t last = --idle->count + 2;
+    idle->polls[slot] = idle->polls[last];
+    idle->since[slot] = idle->since[last];
+}
+
+/**
+ * @brief Takes back the connections the workers are done with
+ */
+static void take_returns(idle_set *idle)
+{
+    int fd;
+    while (read(returns[0], &fd, sizeof(fd)) == sizeof(fd))
+    {
+        if (fd < 0)
+            idle->open--;
+        else
+            add_idle(idle, fd, time(NULL));
+    }
+}
+
+/**
+ * @brief Serves replace requests on a Unix socket with a pool of worker threads until interrupted
+ *
+ * The accept loop polls the connections between requests and hands a connection to a worker
+ * only once its next request arrives. Connections idle for DAEMON_IDLE_SECONDS are closed, and
+ * connections beyond DAEMON_MAX_CONNECTIONS are refused, so their clients run locally.
+ *
+ * @param socketPath Path of the socket to listen on
+ * @return int 0 when stopped by SIGINT or SIGTERM, -1 on failure
+ */
+int run_daemon(const char *socketPath)
+{
+    struct sockaddr_un address;
+    if (socket_address(socketPath, &address) != 0)
+        return -1;
+
+    idle_set *idle = calloc(1, sizeof(idle_set));
+    if (!idle || pipe2(returns, O_CLOEXEC) != 0)
+    {
+        free(idle);
+        return -1;
+    }
+    fcntl(returns[0], F_SETFL, O_NONBLOCK);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(socketPath);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        if (listener >= 0)
+            close(listener);
+        close(returns[0]);
+        close(returns[1]);
+        free(idle);
+        return -1;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    long started = 0;
+    while (threads && started < workers && pthread_create(&threads[started], NULL, worker, NULL) == 0)
+        started++;
+
+    struct timeval timeout = {DAEMON_READ_SECONDS, 0};
+    idle->polls[0].fd = listener;
+    idle->polls[0].events = POLLIN;
+    idle->polls[1].fd = returns[0];
+    idle->polls[1].events = POLLIN;
+
+    while (started > 0 && !stop_daemon)
+    {
+        if (poll(idle->polls, idle->count + 2, 1000) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        time_t now = time(NULL);
+        for (size_t slot = idle->count + 1; slot >= 2; slot--)
+        {
+            if (idle->polls[slot].revents)
+            {
+                enqueue(idle->polls[slot].fd);
+                remove_idle(idle, slot);
+            }
+            else if (now - idle->since[slot] >= DAEMON_IDLE_SECONDS)
+            {
+                close(idle->polls[slot].fd);
+                idle->open--;
+                remove_idle(idle, slot);
+            }
+        }
+
+        if (idle->polls[1].revents)
+            take_returns(idle);
+
+        int fd;
+        while (idle->polls[0].revents && (fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        {
+            if (idle->open == DAEMON_MAX_CONNECTIONS)
+            {
+                close(fd);
+                continue;
+            }
+            // A request that has started must arrive whole, and its reply be read, within the timeout
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            idle->open++;
+            add_idle(idle, fd, now);
+        }
+    }
+
+    close(listener);
+    unlink(socketPath);
+
+    for (long i = 0; i < started; i++)
+        enqueue(-1);
+    for (long i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free_patterns();
+
+    take_returns(idle);
+    for (size_t slot = 2; slot < idle->count + 2; slot++)
+        close(idle->polls[slot].fd);
+    close(returns[0]);
+    close(returns[1]);
+    free(idle);
+
+    return started > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Turns a path into one the daemon can resolve from its own working directory
+ *
+ * Existing files are resolved through their symbolic links, so names like /dev/fd/3 that only
+ * mean something in this process reach the daemon as the file they stand for.
+ *
+ * @return char* Newly allocated absolute path, NULL on failure
+ */
+static char *absolute_path(const char *path)
+{
+    char *resolved = realpath(path, NULL);
+    if (resolved || path[0] == '/')
+        return resolved ? resolved : strdup(path);
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        return NULL;
+
+    size_t length = strlen(cwd) + strlen(path) + 2;
+    char *absolute = malloc(length);
+    if (absolute)
+        snprintf(absolute, length, "%s/%s", cwd, path);
+    free(cwd);
+    return absolute;
+}
+
+/**
+ * @brief Sends the header of a request and the texts that follow it, before the paths or the buffer
+ *
+ * @param fd Daemon socket
+ * @param request Request header, with the lengths filled in
+ * @param options Replacement options, as given on the command line
+ * @param table Path of the --rules or --map file, NULL without one
+ * @return int 0 on success, -1 if the daemon could not be written to
+ */
+static int send_header(int fd, const daemon_request *request, const replace_options *options, const char *table)
+{
+    return write_all(fd, request, sizeof(*request)) == 0 &&
+                   write_all(fd, options->search ? options->search : "", request->search_length) == 0 &&
+                   write_all(fd, options->replace ? options->replace : "", request->replace_length) == 0 &&
+                   write_all(fd, table, request->table_length) == 0
+               ? 0
+               : -1;
+}
+
+/**
+ * @brief Sends the bytes of the input in a buffer request and writes the output the daemon replies with
+ *
+ * @param fd Daemon socket
+ * @param request Request header, with the buffer flag set and the input length filled in
+ * @param options Replacement options, as given on the command line
+ * @param table Path of the --rules or --map file, NULL without one
+ * @param in_fd Descriptor of the input
+ * @param out Output stream
+ * @return int Exit status of the run, -1 if the daemon could not serve it
+ */
+static int send_buffer(int fd, const daemon_request *request, const replace_options *options, const char *table,
+                       int in_fd, FILE *out)
+{
+    char *input = malloc(request->input_length + 1);
+    daemon_response response;
+    int status = -1;
+
+    if (input && read_all(in_fd, input, request->input_length) == 0 &&
+        send_header(fd, request, options, table) == 0 &&
+        write_all(fd, input, request->input_length) == 0 &&
+        read_all(fd, &response, sizeof(response)) == 0)
+    {
+        status = response.status;
+
+        char chunk[COPY_CHUNK];
+        for (uint64_t left = response.length; left > 0 && status >= 0;)
+        {
+            size_t length = left < COPY_CHUNK ? left : COPY_CHUNK;
+            if (read_all(fd, chunk, length) != 0)
+                status = -1;
+            else if (fwrite(chunk, 1, length, out) != length)
+                status = OUTPUT_FILE_UNWRITABLE;
+            left -= length;
+        }
+    }
+
+    free(input);
+    return status;
+}
+
+/**
+ * @brief Sends a run to the daemon instead of processing it locally
+ *
+ * The daemon opens the input and output itself when both are files. An output that is a pipe or
+ * a terminal only exists for this process, so the input bytes are sent instead and the reply is
+ * written to the output here. Inputs, rule files and map files that are not regular files are left
+ * to a local run.
+ *
+ * @param socketPath Path of the daemon socket
+ * @param options Replacement options, as given on the command line; search and replace may be NULL
+ * with a rules or map file
+ * @param binaryMode What to do with binary inputs, as for --binary
+ * @param rulesFile Name of the --rules file, NULL without one
+ * @param mapFile Name of the --map file, NULL without one
+ * @param fuzzyEdits Edits allowed by --fuzzy, 0 for exact matching
+ * @param inputFile Name of the input file
+ * @param outputFile Name of the output file
+ * @return int Exit status of the run, -1 if the daemon could not be reached
+ */
+int run_client(const char *socketPath, const replace_options *options, int binaryMode, const char *rulesFile,
+               const char *mapFile, long fuzzyEdits, const char *inputFile, const char *outputFile)
+{
+    struct sockaddr_un address;
+    struct stat input_stat;
+    struct stat output_stat;
+    struct stat table_stat;
+    const char *tableFile = rulesFile ? rulesFile : mapFile;
+    if (socket_address(socketPath, &address) != 0 || stat(inputFile, &input_stat) != 0 ||
+        !S_ISREG(input_stat.st_mode) || (tableFile && (stat(tableFile, &table_stat) != 0 || !S_ISREG(table_stat.st_mode))))
+        return -1;
+
+    // The daemon loads the table itself, so it is named from the root like the input and output
+    char *table = tableFile ? absolute_path(tableFile) : NULL;
+    if (tableFile && !table)
+        return -1;
+
+    int buffer_mode = stat(outputFile, &output_stat) == 0 && !S_ISREG(output_stat.st_mode);
+    if (buffer_mode && input_stat.st_size > DAEMON_MAX_BUFFER)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        free(table);
+        return -1;
+    }
+
+    daemon_request request = {0};
+    request.magic = DAEMON_MAGIC;
+    request.flags = (options->wildcard ? REQUEST_WILDCARD : 0) | (options->whole_word ? REQUEST_WORD : 0) |
+                    (binaryMode == BINARY_SKIP ? REQUEST_BINARY_SKIP : 0) |
+                    (binaryMode == BINARY_TEXT ? REQUEST_BINARY_TEXT : 0) |
+                    (rulesFile ? REQUEST_RULES : 0) | (mapFile ? REQUEST_MAP : 0) |
+                    (options->search ? REQUEST_PAIR : 0);
+    request.minimum = options->minimum;
+    request.maximum = options->maximum;
+    request.search_length = options->search ? strlen(options->search) : 0;
+    request.replace_length = options->replace ? strlen(options->replace) : 0;
+    request.table_length = table ? strlen(table) : 0;
+    request.edits = (uint32_t)fuzzyEdits;
+    int status = -1;
+
+    if (buffer_mode)
+    {
+        request.flags |= REQUEST_BUFFER;
+        request.input_length = input_stat.st_size;
+
+        int in_fd = open(inputFile, O_RDONLY | O_CLOEXEC);
+        FILE *out = in_fd >= 0 ? fopen(outputFile, "w") : NULL;
+        if (out)
+        {
+            status = send_buffer(fd, &request, options, table, in_fd, out);
+            if (fclose(out) != 0 && status == 0)
+                status = OUTPUT_FILE_UNWRITABLE;
+        }
+        if (in_fd >= 0)
+            close(in_fd);
+        close(fd);
+        free(table);
+        return status;
+    }
+
+    char *input = absolute_path(inputFile);
+    char *output = absolute_path(outputFile);
+
+    if (input && output)
+    {
+        request.input_length = strlen(input);
+        request.output_length = strlen(output);
+
+        daemon_response response;
+        if (send_header(fd, &request, options, table) == 0 &&
+            write_all(fd, input, request.input_length) == 0 &&
+            write_all(fd, output, request.output_length) == 0 &&
+            read_all(fd, &response, sizeof(response)) == 0)
+        {
+            status = response.status;
+        }
+    }
+
+    free(input);
+    free(output);
+    free(table);
+    close(fd);
+    return status;
+}
@@ -0,0 +1,215 @@
+#include "hw5.h"
+
+#define PATCH_MAGIC "HW5PTCH"
+#define NO_NEWLINE "\n\\ No newline at end of file\n"
+
+/**
+ * @brief Header of one record of a binary patch list, followed by new_length bytes
+ */
+typedef struct
+{
+    uint64_t offset;     // Offset of the replaced line in the input
+    uint64_t old_length; // Length of the replaced line
+    uint64_t new_length; // Length of the text replacing it
+} patch_record;
+
+/**
+ * @brief Counts the lines a block of text spans in a diff
+ */
+static long count_diff_lines(const char *text, size_t length)
+{
+    long count = 0;
+    for (const char *cursor = text; (cursor = memchr(cursor, '\n', text + length - cursor)) != NULL; cursor++)
+        count++;
+    return count + (length > 0 && text[length - 1] != '\n');
+}
+
+/**
+ * @brief Writes text to the current hunk, one prefixed diff line per line of text
+ *
+ * @param hunk Hunk being built
+ * @param prefix ' ', '-' or '+'
+ * @param text Text to write
+ * @param length Length of the text
+ */
+static void write_hunk_text(text_buffer *hunk, char prefix, const char *text, size_t length)
+{
+    const char *end = text + length;
+    while (text < end)
+    {
+        const char *newline = memchr(text, '\n', end - text);
+        const char *line_end = newline ? newline + 1 : end;
+
+        buffer_append(hunk, &prefix, 1);
+        buffer_append(hunk, text, line_end - text);
+        if (!newline)
+            buffer_append(hunk, NO_NEWLINE, sizeof(NO_NEWLINE) - 1);
+        text = line_end;
+    }
+}
+
+/**
+ * @brief Ends a run of changed lines, so its '+' lines follow all of its '-' lines as diff(1) writes them
+ */
+static void end_change_run(diff_writer *diff)
+{
+    buffer_append(&diff->hunk, diff->added.data, diff->added.length);
+    diff->added.length = 0;
+}
+
+/**
+ * @brief Remembers an unchanged line as potential leading context of the next hunk
+ */
+static void push_context(diff_writer *diff, const char *line, size_t length)
+{
+    size_t slot = (diff->context_first + diff->context_count) % DIFF_CONTEXT;
+    if (diff->context_count == DIFF_CONTEXT)
+    {
+        diff->context_first = (diff->context_first + 1) % DIFF_CONTEXT;
+    }
+    else
+    {
+        diff->context_count++;
+    }
+
+    diff->context[slot].length = 0;
+    buffer_append(&diff->context[slot], line, length);
+}
+
+/**
+ * @brief Writes the current hunk, with its header, to the output
+ */
+static void flush_hunk(diff_writer *diff)
+{
+    if (!diff->hunk_open)
+        return;
+
+    end_change_run(diff);
+    if (!diff->header_written)
+    {
+        fprintf(diff->out, "--- %s\n+++ %s\n", diff->label, diff->label);
+        diff->header_written = 1;
+    }
+
+    // An empty side is numbered after the line it follows, as diff(1) does
+    fprintf(diff->out, "@@ -%ld,%ld +%ld,%ld @@\n",
+            diff->old_count ? diff->old_start : diff->old_start - 1, diff->old_count,
+            diff->new_count ? diff->new_start : diff->new_start - 1, diff->new_count);
+    fwrite(diff->hunk.data, 1, diff->hunk.length, diff->out);
+
+    diff->hunk.length = 0;
+    diff->hunk_open = 0;
+}
+
+/**
+ * @brief Starts a diff of the lines of one run
+ *
+ * @param diff Writer to set up
+ * @param out Stream the diff is written to
+ * @param options Replacement options, giving the format and label
+ */
+void diff_begin(diff_writer *diff, FILE *out, const replace_options *options)
+{
+    memset(diff, 0, sizeof(*diff));
+    diff->out = out;
+    diff->format = options->diff;
+    diff->label = options->label ? options->label : "-";
+
+    if (diff->format == DIFF_PATCH)
+        fwrite(PATCH_MAGIC, 1, sizeof(PATCH_MAGIC), out);
+}
+
+/**
+ * @brief Adds one input line and the text it became to the diff
+ *
+ * @param diff Writer
+ * @param line Number of the line in the input
+ * @param offset Offset of the line in the input
+ * @param old Original line
+ * @param old_length Length of the original line
+ * @param new Text the line was turned into
+ * @param new_length Length of that text
+ */
+void diff_line(diff_writer *diff, long line, off_t offset, const char *old, size_t old_length,
+               const char *new, size_t new_length)
+{
+    int changed = old != new && (old_length != new_length || memcmp(old, new, old_length) != 0);
+
+    if (diff->format == DIFF_PATCH)
+    {
+        if (changed)
+        {
+            patch_record record = {(uint64_t)offset, old_length, new_length};
+            fwrite(&record, sizeof(record), 1, diff->out);
+            fwrite(new, 1, new_length, diff->out);
+        }
+        return;
+    }
+
+    if (!changed)
+    {
+        if (diff->hunk_open)
+            end_change_run(diff);
+
+        if (diff->hunk_open && diff->trailing > 0)
+        {
+            write_hunk_text(&diff->hunk, ' ', old, old_length);
+            diff->old_count++;
+            diff->new_count++;
+            diff->trailing--;
+            return;
+        }
+
+        push_context(diff, old, old_length);
+        diff->gap++;
+
+        // Far enough from the last change that the next one starts a hunk of its own
+        if (diff->hunk_open && diff->gap > DIFF_CONTEXT)
+            flush_hunk(diff);
+        return;
+    }
+
+    if (!diff->hunk_open)
+    {
+        diff->hunk_open = 1;
+        diff->old_start = line - diff->context_count;
+        diff->new_start = diff->old_start + diff->delta;
+        diff->old_count = 0;
+        diff->new_count = 0;
+    }
+
+    // Unchanged lines since the last change, or leading context of a new hunk
+    for (size_t i = 0; i < diff->context_count; i++)
+    {
+        const text_buffer *context = &diff->context[(diff->context_first + i) % DIFF_CONTEXT];
+        write_hunk_text(&diff->hunk, ' ', context->data, context->length);
+        diff->old_count++;
+        diff->new_count++;
+    }
+    diff->context_count = 0;
+    diff->context_first = 0;
+
+    long old_lines = count_diff_lines(old, old_length);
+    long new_lines = count_diff_lines(new, new_length);
+    write_hunk_text(&diff->hunk, '-', old, old_length);
+    write_hunk_text(&diff->added, '+', new, new_length);
+    diff->old_count += old_lines;
+    diff->new_count += new_lines;
+    diff->delta += new_lines - old_lines;
+    diff->trailing = DIFF_CONTEXT;
+    diff->gap = 0;
+}
+
+/**
+ * @brief Finishes the diff and releases the writer
+ *
+ * @param diff Writer
+ */
+void diff_end(diff_writer *diff)
+{
+    flush_hunk(diff);
+    free(diff->hunk.data);
+    free(diff->added.data);
+    for (size_t i = 0; i < DIFF_CONTEXT; i++)
+        free(diff->context[i].data);
+}
@@ -0,0 +1,295 @@
+#include "hw5.h"
+
+/**
+ * @brief Turns a mask of quote characters into the mask of the bytes inside quotes
+ *
+ * Each quote flips the state, so the running XOR of the quote bits marks an opening quote and
+ * everything up to the closing one. A doubled quote flips twice and changes nothing.
+ */
+static uint64_t prefix_xor(uint64_t mask)
+{
+    mask ^= mask << 1;
+    mask ^= mask << 2;
+    mask ^= mask << 4;
+    mask ^= mask << 8;
+    mask ^= mask << 16;
+    mask ^= mask << 32;
+    return mask;
+}
+
+/**
+ * @brief Finds the delimiters and newlines of a block that lie outside quotes
+ *
+ * @param block Bytes to scan
+ * @param length Number of bytes, at most SCAN_BLOCK
+ * @param delimiter Field delimiter
+ * @param quoted All ones when the block starts inside quotes, zero otherwise; updated for the next block
+ * @param delimiters Receives the mask of the delimiters outside quotes
+ * @param newlines Receives the mask of the newlines outside quotes
+ */
+static void scan_block(const char *block, size_t length, char delimiter, uint64_t *quoted, uint64_t *delimiters,
+                       uint64_t *newlines)
+{
+    char padded[SCAN_BLOCK];
+    if (length < SCAN_BLOCK)
+    {
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, block, length);
+        block = padded;
+    }
+
+    uint64_t inside = prefix_xor(byte_mask(block, QUOTE)) ^ *quoted;
+    *quoted = (inside >> 63) ? UINT64_MAX : 0;
+    *delimiters = byte_mask(block, delimiter) & ~inside;
+    *newlines = byte_mask(block, '\n') & ~inside;
+}
+
+/**
+ * @brief Finds the end of the first record of a block, a newline outside quotes
+ *
+ * @param data Bytes starting at the start of a record
+ * @param length Number of bytes
+ * @param delimiter Field delimiter
+ * @return size_t Length of the record with its newline, length if it does not end in the block
+ */
+size_t next_record(const char *data, size_t length, char delimiter)
+{
+    uint64_t quoted = 0;
+    uint64_t delimiters;
+    uint64_t newlines;
+
+    for (size_t offset = 0; offset < length; offset += SCAN_BLOCK)
+    {
+        size_t block = length - offset < SCAN_BLOCK ? length - offset : SCAN_BLOCK;
+        scan_block(data + offset, block, delimiter, &quoted, &delimiters, &newlines);
+        if (newlines)
+            return offset + __builtin_ctzll(newlines) + 1;
+    }
+    return length;
+}
+
+/**
+ * @brief Finds how much of a block is made of complete records
+ *
+ * @param data Bytes starting at the start of a record
+ * @param length Number of bytes
+ * @param delimiter Field delimiter
+ * @return size_t Length up to the last newline outside quotes, 0 if there is none
+ */
+size_t complete_records(const char *data, size_t length, char delimiter)
+{
+    uint64_t quoted = 0;
+    uint64_t delimiters;
+    uint64_t newlines;
+    size_t complete = 0;
+
+    for (size_t offset = 0; offset < length; offset += SCAN_BLOCK)
+    {
+        size_t block = length - offset < SCAN_BLOCK ? length - offset : SCAN_BLOCK;
+        scan_block(data + offset, block, delimiter, &quoted, &delimiters, &newlines);
+        if (newlines)
+            complete = offset + (SCAN_BLOCK - 1 - __builtin_clzll(newlines)) + 1;
+    }
+    return complete;
+}
+
+/**
+ * @brief Locates a field of a record
+ *
+ * @param record Record, with or without its newline
+ * @param length Length of the record
+ * @param delimiter Field delimiter
+ * @param field Number of the field, starting at 1
+ * @param start Receives the offset of the field
+ * @param end Receives the offset just past the field, before any "\r\n"
+ * @return int 1 if the record has the field, 0 otherwise
+ */
+static int find_field(const char *record, size_t length, char delimiter, int field, size_t *start, size_t *end)
+{
+    uint64_t quoted = 0;
+    uint64_t delimiters;
+    uint64_t newlines;
+    int current = 1;
+    *start = 0;
+    *end = length;
+
+    for (size_t offset = 0; offset < length; offset += SCAN_BLOCK)
+    {
+        size_t block = length - offset < SCAN_BLOCK ? length - offset : SCAN_BLOCK;
+        scan_block(record + offset, block, delimiter, &quoted, &delimiters, &newlines);
+
+        for (uint64_t structural = delimiters | newlines; structural; structural &= structural - 1)
+        {
+            int bit = __builtin_ctzll(structural);
+            size_t position = offset + bit;
+            if (current == field)
+            {
+                *end = position;
+                goto found;
+            }
+            if (newlines & (1ULL << bit))
+                return 0; // The record ends before the field
+            current++;
+            *start = position + 1;
+        }
+    }
+
+    if (current != field)
+        return 0;
+
+found:
+    if (*end > *start && record[*end - 1] == '\r' && (*end == length || record[*end] == '\n'))
+        (*end)--;
+    return 1;
+}
+
+/**
+ * @brief Appends a field value, quoting it when it holds a delimiter, a quote or a line break
+ */
+static void append_value(text_buffer *output, const char *value, size_t length, char delimiter, int quote)
+{
+    for (size_t i = 0; !quote && i < length; i++)
+        quote = value[i] == delimiter || value[i] == QUOTE || value[i] == '\n' || value[i] == '\r';
+
+    if (!quote)
+    {
+        buffer_append(output, value, length);
+        return;
+    }
+
+    const char quote_char = QUOTE;
+    buffer_append(output, &quote_char, 1);
+    const char *end = value + length;
+    const char *next;
+    while ((next = memchr(value, QUOTE, end - value)) != NULL)
+    {
+        buffer_append(output, value, next - value + 1);
+        buffer_append(output, &quote_char, 1); // Doubled, as CSV escapes it
+        value = next + 1;
+    }
+    buffer_append(output, value, end - value);
+    buffer_append(output, &quote_char, 1);
+}
+
+/**
+ * @brief Applies the replacement to one field of a CSV/TSV record, leaving the others untouched
+ *
+ * A quoted field is matched on its unescaped value and written back quoted. An unquoted field
+ * gets quotes only when the replacement brings in a delimiter, a quote or a line break.
+ *
+ * @param record Record, with its newline
+ * @param length Length of the record
+ * @param options Replacement options, with field and delimiter set
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified record is appended to
+ * @return int Number of replacements made
+ */
+int field_replace(const char *record, size_t length, const replace_options *options, uint64_t limit,
+                  text_buffer *output)
+{
+    size_t start;
+    size_t end;
+    if (!find_field(record, length, options->delimiter, options->field, &start, &end))
+    {
+        buffer_append(output, record, length);
+        return 0;
+    }
+
+    const char *field = record + start;
+    size_t field_length = end - start;
+    int quoted = field_length > 0 && field[0] == QUOTE;
+    size_t tail = field_length; // Start of anything after the closing quote
+    text_buffer value = {NULL, 0, 0};
+
+    if (quoted)
+    {
+        size_t i = 1;
+        while (i < field_length)
+        {
+            const char *next = memchr(field + i, QUOTE, field_length - i);
+            size_t stop = next ? (size_t)(next - field) : field_length;
+            buffer_append(&value, field + i, stop - i);
+            if (!next)
+            {
+                i = field_length;
+                break;
+            }
+            if (stop + 1 < field_length && field[stop + 1] == QUOTE)
+            {
+                buffer_append(&value, field + stop, 1);
+                i = stop + 2;
+                continue;
+            }
+            i = stop + 1;
+            break;
+        }
+        tail = i;
+    }
+
+    // The matchers see the field's value as a line of its own; an unquoted one is matched in place
+    const char *matched = quoted ? (value.data ? value.data : "") : field;
+    size_t matched_length = quoted ? value.length : field_length;
+    replace_options inner = *options;
+    inner.field = 0;
+    text_buffer replaced = {NULL, 0, 0};
+    int count = replace_line(matched, matched_length, &inner, limit, &replaced);
+
+    if (count == 0)
+    {
+        buffer_append(output, record, length);
+    }
+    else
+    {
+        buffer_append(output, record, start);
+        append_value(output, replaced.data, replaced.length, options->delimiter, quoted);
+        buffer_append(output, field + tail, field_length - tail);
+        buffer_append(output, record + end, length - end);
+    }
+
+    free(value.data);
+    free(replaced.data);
+    return count;
+}
+
+/**
+ * @brief Extends a line read with getline() into a whole record, while a quoted field is open
+ *
+ * @param fptr Input file
+ * @param bfr Line buffer, holding the first line of the record; grown
+ * @param capacity Capacity of the buffer, updated
+ * @param length Length of the line
+ * @return ssize_t Length of the record
+ */
+ssize_t join_record(FILE *fptr, char **bfr, size_t *capacity, ssize_t length)
+{
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t got;
+    size_t quotes = 0;
+
+    for (const char *cursor = *bfr; (cursor = memchr(cursor, QUOTE, *bfr + length - cursor)) != NULL; cursor++)
+        quotes++;
+
+    while (quotes % 2 == 1 && (got = getline(&line, &line_capacity, fptr)) != -1)
+    {
+        if ((size_t)(length + got + 1) > *capacity)
+        {
+            size_t grown = (length + got + 1) * 2;
+            char *resized = realloc(*bfr, grown);
+            if (!resized)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            *bfr = resized;
+            *capacity = grown;
+        }
+        memcpy(*bfr + length, line, got + 1);
+        for (const char *cursor = line; (cursor = memchr(cursor, QUOTE, line + got - cursor)) != NULL; cursor++)
+            quotes++;
+        length += got;
+    }
+
+    free(line);
+    return length;
+}
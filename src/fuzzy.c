@@ -0,0 +1,304 @@
+#include "hw5.h"
+
+#define FUZZY_STACK_WORDS 64 // Scratch kept on the stack; longer patterns allocate it
+
+/**
+ * @brief Compiles a literal for approximate matching
+ *
+ * @param pattern Pattern to fill in, released with free_fuzzy()
+ * @param text Literal to look for
+ * @param length Length of the literal, more than edits
+ * @param edits Most edits a match may differ by
+ */
+void compile_fuzzy(fuzzy_pattern *pattern, const char *text, size_t length, int edits)
+{
+    pattern->length = length;
+    pattern->blocks = (length + 63) / 64;
+    pattern->edits = edits;
+    pattern->text = text;
+    pattern->peq = calloc(256 * pattern->blocks, sizeof(uint64_t));
+    if (!pattern->peq)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < length; i++)
+        pattern->peq[(unsigned char)text[i] * pattern->blocks + i / 64] |= 1ULL << (i % 64);
+
+    // Pieces as even as possible; with too many, every line goes through the matcher
+    size_t count = (size_t)edits + 1;
+    pattern->piece_count = count <= FUZZY_MAX_PIECES ? count : 0;
+    for (size_t i = 0; pattern->piece_count && i <= count; i++)
+        pattern->pieces[i] = i * length / count;
+}
+
+/**
+ * @brief Releases what compile_fuzzy() allocated
+ */
+void free_fuzzy(fuzzy_pattern *pattern)
+{
+    free(pattern->peq);
+    pattern->peq = NULL;
+}
+
+/**
+ * @brief Tells whether a block of text may hold an approximate match, from the pattern's pieces
+ *
+ * @return int 1 if some piece occurs unchanged, or the pattern has no pieces; 0 otherwise
+ */
+int fuzzy_candidate(const fuzzy_pattern *pattern, const char *data, size_t length)
+{
+    if (!pattern->piece_count)
+        return 1;
+
+    for (size_t i = 0; i < pattern->piece_count; i++)
+    {
+        const char *piece = pattern->text + pattern->pieces[i];
+        if (memmem(data, length, piece, pattern->pieces[i + 1] - pattern->pieces[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Advances one 64-row block of the distance matrix by one text character
+ *
+ * Myers' step over the vertical deltas of the block, encoded as the +1 bits (pv) and -1 bits
+ * (mv); the horizontal delta entering at the top row is hin and the one leaving at the block's
+ * last row is returned, so blocks chain into patterns of any length.
+ *
+ * @param pv +1 vertical deltas, updated
+ * @param mv -1 vertical deltas, updated
+ * @param eq Rows of the block whose pattern byte is the text character
+ * @param hin Horizontal delta entering the block, -1, 0 or +1
+ * @param high Bit of the block's last row
+ * @return int Horizontal delta leaving the block
+ */
+static int advance_block(uint64_t *pv, uint64_t *mv, uint64_t eq, int hin, uint64_t high)
+{
+    uint64_t xv = eq | *mv;
+    if (hin < 0)
+        eq |= 1;
+    uint64_t xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+    uint64_t ph = *mv | ~(xh | *pv);
+    uint64_t mh = *pv & xh;
+
+    int hout = 0;
+    if (ph & high)
+        hout = 1;
+    else if (mh & high)
+        hout = -1;
+
+    ph <<= 1;
+    mh <<= 1;
+    if (hin < 0)
+        mh |= 1;
+    else if (hin > 0)
+        ph |= 1;
+
+    *pv = mh | ~(xv | ph);
+    *mv = ph & xv;
+    return hout;
+}
+
+/**
+ * @brief Column of the distance matrix, for a scan starting at some text position
+ */
+typedef struct
+{
+    const fuzzy_pattern *pattern;
+    uint64_t *pv;
+    uint64_t *mv;
+    size_t score; // Distance between the whole pattern and the text up to the current position
+    int anchored; // Whether the match must start where the scan started
+} fuzzy_scan;
+
+static void start_scan(fuzzy_scan *scan)
+{
+    for (size_t b = 0; b < scan->pattern->blocks; b++)
+    {
+        scan->pv[b] = UINT64_MAX;
+        scan->mv[b] = 0;
+    }
+    scan->score = scan->pattern->length;
+}
+
+static void scan_byte(fuzzy_scan *scan, unsigned char c)
+{
+    const fuzzy_pattern *pattern = scan->pattern;
+    const uint64_t *eq = pattern->peq + c * pattern->blocks;
+    size_t last = pattern->blocks - 1;
+
+    // Row 0 costs one more per text character when the match cannot start later
+    int carry = scan->anchored ? 1 : 0;
+    for (size_t b = 0; b < last; b++)
+        carry = advance_block(&scan->pv[b], &scan->mv[b], eq[b], carry, 1ULL << 63);
+    carry = advance_block(&scan->pv[last], &scan->mv[last], eq[last], carry, 1ULL << ((pattern->length - 1) % 64));
+    scan->score += carry;
+}
+
+/**
+ * @brief Finds where an approximate match ending at a position starts
+ *
+ * Edit distance between the pattern and the text ending at end, anchored at end, for every start
+ * back to lower. The closest start wins, the nearest one among equals.
+ *
+ * @param column Scratch of length + 1 entries
+ * @return const char* Start of the match
+ */
+static const char *match_start(const fuzzy_pattern *pattern, const char *lower, const char *end, uint64_t *column)
+{
+    size_t length = pattern->length;
+    const char *start = end;
+    uint64_t best = length;
+
+    for (size_t i = 0; i <= length; i++)
+        column[i] = i;
+
+    for (const char *cursor = end; cursor > lower;)
+    {
+        char c = *--cursor;
+        uint64_t diagonal = column[0];
+        column[0] = end - cursor;
+        for (size_t i = 1; i <= length; i++)
+        {
+            uint64_t above = column[i];
+            uint64_t value = diagonal + (pattern->text[length - i] != c);
+            if (above + 1 < value)
+                value = above + 1;
+            if (column[i - 1] + 1 < value)
+                value = column[i - 1] + 1;
+            diagonal = above;
+            column[i] = value;
+        }
+        if (column[length] < best)
+        {
+            best = column[length];
+            start = cursor;
+        }
+    }
+    return start;
+}
+
+/**
+ * @brief Replaces the substrings of a line within k edits of a literal, or the whole words within
+ * k edits of it
+ *
+ * A substring match ends at the lowest distance among the first run of ends within k edits, and
+ * starts at the closest start for that end. A word match is the closest span from a word start to
+ * a word end. Lines without any piece of the pattern are copied without running the matcher.
+ *
+ * @param line Line
+ * @param length Length of the line
+ * @param pattern Compiled pattern
+ * @param whole_word Non-zero to match whole words only
+ * @param with Text to replace matches with
+ * @param with_length Length of the replacement
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of replacements made
+ */
+int fuzzy_replace(const char *line, size_t length, const fuzzy_pattern *pattern, int whole_word, const char *with,
+                  size_t with_length, uint64_t limit, text_buffer *output)
+{
+    if (!fuzzy_candidate(pattern, line, length))
+    {
+        buffer_append(output, line, length);
+        return 0;
+    }
+
+    size_t words = 2 * pattern->blocks + pattern->length + 1;
+    uint64_t stack[FUZZY_STACK_WORDS];
+    uint64_t *scratch = words <= FUZZY_STACK_WORDS ? stack : malloc(words * sizeof(uint64_t));
+    if (!scratch)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    fuzzy_scan scan = {pattern, scratch, scratch + pattern->blocks, 0, whole_word};
+    uint64_t *column = scratch + 2 * pattern->blocks;
+    size_t edits = pattern->edits;
+    size_t reach = pattern->length + edits; // Longest text a match can span
+    const char *line_end = line + length;
+    const char *copied = line;
+    const char *cursor = line;
+    int replaced = 0;
+
+    // An edit must not take the newline, or two lines would merge
+    const char *end = length > 0 && line_end[-1] == '\n' ? line_end - 1 : line_end;
+
+    while ((uint64_t)replaced < limit && cursor < end)
+    {
+        const char *match = NULL;
+        const char *match_end = NULL;
+
+        if (whole_word)
+        {
+            const char *word = skip_non_word_characters(cursor, end);
+            if (word == end)
+                break;
+
+            size_t best = edits + 1;
+            const char *stop = (size_t)(end - word) < reach ? end : word + reach;
+            start_scan(&scan);
+            for (const char *c = word; c < stop; c++)
+            {
+                scan_byte(&scan, *c);
+                if (scan.score < best && (c + 1 == end || is_word_boundary(c[1])) && !is_word_boundary(*c))
+                {
+                    best = scan.score;
+                    match_end = c + 1;
+                }
+            }
+
+            if (!match_end)
+            {
+                cursor = skip_word(word, end);
+                continue;
+            }
+            match = word;
+        }
+        else
+        {
+            start_scan(&scan);
+            const char *c = cursor;
+            while (c < end && !match_end)
+            {
+                scan_byte(&scan, *c++);
+                if (scan.score <= edits)
+                    match_end = c;
+            }
+            if (!match_end)
+                break;
+
+            // Take the lowest distance of the run of ends within k edits
+            size_t best = scan.score;
+            while (c < end)
+            {
+                scan_byte(&scan, *c++);
+                if (scan.score > edits)
+                    break;
+                if (scan.score < best)
+                {
+                    best = scan.score;
+                    match_end = c;
+                }
+            }
+
+            const char *lower = (size_t)(match_end - cursor) < reach ? cursor : match_end - reach;
+            match = match_start(pattern, lower, match_end, column);
+        }
+
+        buffer_append(output, copied, match - copied);
+        buffer_append(output, with, with_length);
+        copied = cursor = match_end;
+        replaced++;
+    }
+
+    buffer_append(output, copied, line_end - copied);
+    if (scratch != stack)
+        free(scratch);
+    return replaced;
+}
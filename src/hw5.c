@@ -1,45 +1,8 @@
 #include "hw5.h"
 
-int is_word_boundary(char c);
-int match_prefix(const char *str, const char *prefix);
-int match_suffix(const char *str, const char *suffix);
-
-/**
- * @brief Counts number of lines in a file
- *
- * @param filename Name of the file
- * @return int Number of lines
- */
-int countLines(const char *filename)
-{
-    FILE *file = fopen(filename, "r");
-    if (!file)
-    {
-        perror("Failed to open file");
-        return -1;
-    }
-
-    int count = 0;
-    char ch;
-
-    while ((ch = fgetc(file)) != EOF)
-    {
-        if (ch == '\n')
-        {
-            count++;
-        }
-    }
-
-    fclose(file);
-
-    // Account for files that don't end with a newline
-    if (ch != '\n' && count != 0)
-    {
-        count++;
-    }
-
-    return count;
-}
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 /**
  * @brief Checks if argv contains a specific flag
@@ -49,7 +12,7 @@ int countLines(const char *filename)
  * @param flag Flag to check
  * @return int 1 if flag exists 0 if doesn't
  */
-int contains(int argc, const char *argv[], char *flag)
+int contains(int argc, char *argv[], char *flag)
 {
     for (int i = 0; i < argc; i++)
     {
@@ -75,153 +38,551 @@ int is_word_boundary(char c)
 /**
  * @brief Checks for specific prefix in a word
  *
- * @param str word to check
- * @param prefix prefix to look for
+ * @param word Word to check, which need not be NUL-terminated
+ * @param length Length of the word
+ * @param prefix Prefix to look for, without its '*'
+ * @param prefix_length Length of the prefix
  * @return int if found then 1 or else 0
  */
-int match_prefix(const char *str, const char *prefix)
+int match_prefix(const char *word, size_t length, const char *prefix, size_t prefix_length)
 {
-    return strncmp(str, prefix, strlen(prefix) - 1) == 0;
+    return length >= prefix_length && memcmp(word, prefix, prefix_length) == 0;
 }
 
 /**
  * @brief Checks for specific suffix in a word
  *
- * @param str word to check
- * @param suffix suffic to look for
+ * @param word Word to check, which need not be NUL-terminated
+ * @param length Length of the word
+ * @param suffix Suffix to look for, without its '*'
+ * @param suffix_length Length of the suffix
  * @return int if found then 1 or else 0
  */
-int match_suffix(const char *str, const char *suffix)
+int match_suffix(const char *word, size_t length, const char *suffix, size_t suffix_length)
 {
-    size_t str_len = strlen(str);
-    size_t suffix_len = strlen(suffix) - 1;
-    return str_len >= suffix_len && strcmp(str + str_len - suffix_len, suffix + 1) == 0;
+    return length >= suffix_length && memcmp(word + length - suffix_length, suffix, suffix_length) == 0;
+}
+
+/**
+ * @brief Finds the end of the run of non-word characters starting at a position
+ *
+ * @param start Start of the run
+ * @param end End of the line
+ * @return const char* First word character, or end
+ */
+const char *skip_non_word_characters(const char *start, const char *end)
+{
+    while (start < end && is_word_boundary(*start))
+    {
+        start++;
+    }
+    return start;
 }
 
 /**
- * @brief Copies non-word characters from the word start pointer to the output pointer.
- * @param output Pointer to a pointer of the destination where non-word characters will be copied to.
- * @param word_start Pointer to a pointer of the source where non-word characters are copied from.
+ * @brief Finds the end of the word starting at a position
+ *
+ * @param start Start of the word
+ * @param end End of the line
+ * @return const char* First character after the word, or end
  */
-void copy_non_word_characters(char **output, char **word_start)
+const char *skip_word(const char *start, const char *end)
 {
-    while (**word_start && is_word_boundary(**word_start))
+    while (start < end && !is_word_boundary(*start))
     {
-        *(*output)++ = *(*word_start)++; // Copy non-word characters
+        start++;
     }
+    return start;
 }
 
 /**
- * @brief Temporarily terminates a word by placing a null terminator at the word end.
- * @param word_end Pointer to the end of the word which will be temporarily null-terminated.
- * @return The original character that was at the word end before null-termination.
+ * @brief Checks for a wildcard and then replaces specified word with a particular word
+ *
+ * The line is only read, as (pointer, length) spans, so it may live in read-only memory.
+ *
+ * @param line Line to search word in
+ * @param length Length of the line
+ * @param search_text Word to search for, with its '*'
+ * @param search_length Length of the search text
+ * @param replacement Word to replace the search word with
+ * @param replacement_length Length of the replacement
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of words replaced
  */
+int wildcard_replace(const char *line, size_t length, const char *search_text, size_t search_length,
+                     const char *replacement, size_t replacement_length, uint64_t limit, text_buffer *output)
+{
+    int prefix_search = search_text[search_length - 1] == '*';
+    const char *affix = prefix_search ? search_text : search_text + 1;
+    size_t affix_length = search_length - 1;
+    const char *end = line + length;
+    const char *copied = line;
+    const char *word_end = line;
+    int replaced = 0;
+
+    while ((uint64_t)replaced < limit && word_end < end)
+    {
+        const char *word_start = skip_non_word_characters(word_end, end);
+        word_end = skip_word(word_start, end);
+        size_t word_length = word_end - word_start;
+
+        if (word_length > 0 &&
+            (prefix_search ? match_prefix(word_start, word_length, affix, affix_length)
+                           : match_suffix(word_start, word_length, affix, affix_length)))
+        {
+            buffer_append(output, copied, word_start - copied); // Copy up to the word unchanged
+            buffer_append(output, replacement, replacement_length);
+            copied = word_end;
+            replaced++;
+        }
+    }
 
-char temporarily_terminate_word(char *word_end)
+    buffer_append(output, copied, end - copied);
+    return replaced;
+}
+
+/**
+ * @brief Normal replacing a specific word with a particular word
+ *
+ * @param source Line
+ * @param length Length of the line
+ * @param substring Substring to check
+ * @param substring_length Length of the substring
+ * @param with Word to replace with
+ * @param with_length Length of the replacement
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of replacements made
+ */
+int string_replace(const char *source, size_t length, const char *substring, size_t substring_length,
+                   const char *with, size_t with_length, uint64_t limit, text_buffer *output)
 {
-    char temp = *word_end;
-    *word_end = '\0';
-    return temp;
+    const char *end = source + length;
+    const char *substring_source;
+    int replaced = 0;
+
+    // Resume after each replacement so text inside the replacement is never matched again
+    while (substring_length > 0 && (uint64_t)replaced < limit &&
+           (substring_source = memmem(source, end - source, substring, substring_length)) != NULL)
+    {
+        buffer_append(output, source, substring_source - source);
+        buffer_append(output, with, with_length);
+        source = substring_source + substring_length;
+        replaced++;
+    }
+
+    buffer_append(output, source, end - source);
+    return replaced;
 }
 
 /**
- * @brief Restores the original character at the end of a word after a temporary null termination.
+ * @brief Replaces occurrences of a literal that form whole words, as wildcard mode delimits them
+ *
+ * Candidates come from the same substring scan as string_replace(); word boundaries are only
+ * checked on the two characters around each candidate.
  *
- * @param word_end Pointer to the end of the word where the original character is to be restored.
- * @param original_char The original character to be restored at the word end.
+ * @param source Line
+ * @param length Length of the line
+ * @param word Literal to look for
+ * @param word_length Length of the literal
+ * @param with Word to replace with
+ * @param with_length Length of the replacement
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of replacements made
  */
+int word_replace(const char *source, size_t length, const char *word, size_t word_length,
+                 const char *with, size_t with_length, uint64_t limit, text_buffer *output)
+{
+    const char *line = source;
+    const char *end = source + length;
+    const char *cursor = source;
+    const char *candidate;
+    int replaced = 0;
+
+    while (word_length > 0 && (uint64_t)replaced < limit &&
+           (candidate = memmem(cursor, end - cursor, word, word_length)) != NULL)
+    {
+        const char *after = candidate + word_length;
+        if ((candidate == line || is_word_boundary(candidate[-1])) && (after == end || is_word_boundary(*after)))
+        {
+            buffer_append(output, source, candidate - source);
+            buffer_append(output, with, with_length);
+            source = cursor = after;
+            replaced++;
+        }
+        else
+        {
+            cursor = candidate + 1; // Part of a longer word; a match may still start inside it
+        }
+    }
 
-void restore_original_character(char *word_end, char original_char)
+    buffer_append(output, source, end - source);
+    return replaced;
+}
+
+/**
+ * @brief Validates the search text and fills in the lengths derived from the options
+ *
+ * @param options Options whose search, replace and wildcard fields are set
+ * @return int 0 if the pattern is usable, WILDCARD_INVALID otherwise
+ */
+int compile_pattern(replace_options *options)
 {
-    *word_end = original_char;
+    options->search_length = strlen(options->search);
+    options->replace_length = strlen(options->replace);
+
+    if (options->wildcard)
+    {
+        const char *search = options->search;
+        size_t last = options->search_length ? options->search_length - 1 : 0;
+
+        if (options->search_length == 0)
+            return WILDCARD_INVALID;
+
+        if (search[0] != '*' && search[last] != '*')
+            return WILDCARD_INVALID;
+
+        if (search[0] == '*' && search[last] == '*')
+            return WILDCARD_INVALID;
+    }
+
+    return 0;
 }
 
 /**
- * @brief Performs the replacement of a word by copying the replacement text to the output.
+ * @brief Applies the configured replacement to a single line
  *
- * @param output Pointer to a pointer of the destination where the replacement text will be copied.
- * @param word_start Pointer to the start of the word in the original text (unused in this function).
- * @param replacement The replacement text that will be copied to the output.
+ * @param bfr Line to search
+ * @param length Length of the line
+ * @param options Replacement options
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of replacements made
  */
+int replace_line(const char *bfr, size_t length, const replace_options *options, uint64_t limit,
+                 text_buffer *output)
+{
+    if (options->field)
+    {
+        return field_replace(bfr, length, options, limit, output);
+    }
+
+    if (options->rules)
+    {
+        return rules_replace(bfr, length, options->rules, limit, output);
+    }
+
+    if (options->map)
+    {
+        return map_replace(bfr, length, options->map, limit, output);
+    }
+
+    if (options->fuzzy)
+    {
+        return fuzzy_replace(bfr, length, options->fuzzy, options->whole_word, options->replace,
+                             options->replace_length, limit, output);
+    }
 
-void perform_replacement(char **output, const char *word_start, const char *replacement)
+    if (options->wildcard)
+    {
+        return wildcard_replace(bfr, length, options->search, options->search_length,
+                                options->replace, options->replace_length, limit, output);
+    }
+
+    if (options->whole_word)
+    {
+        return word_replace(bfr, length, options->search, options->search_length,
+                            options->replace, options->replace_length, limit, output);
+    }
+
+    return string_replace(bfr, length, options->search, options->search_length,
+                          options->replace, options->replace_length, limit, output);
+}
+
+/**
+ * @brief Number of replacements a run may still make under --max-count
+ *
+ * @param options Replacement options
+ * @param made Replacements made so far
+ * @return uint64_t Replacements left, UINT64_MAX without a limit
+ */
+uint64_t replacements_left(const replace_options *options, uint64_t made)
 {
-    *output += sprintf(*output, "%s", replacement); // Replace word
+    if (!options->max_count)
+        return UINT64_MAX;
+    return made < options->max_count ? options->max_count - made : 0;
 }
 
 /**
- * @brief Checks for a wildcard and then replaces specified word with a particular word
+ * @brief Replaces within the lines of a buffer that is only read, such as a read-only mapping
  *
- * @param line Line to search word in
- * @param search_text Word to search for
- * @param replacement Word to replace the search word with
+ * @param data Input bytes, starting at the start of line first_line
+ * @param length Number of bytes
+ * @param options Replacement options, without a diff format
+ * @param first_line Number of the line data starts at
+ * @param limit Most replacements to make, UINT64_MAX for no limit
+ * @param output Buffer the replaced text is appended to
+ * @return uint64_t Number of replacements made
  */
-void wildcard_replace(char *line, const char *search_text, const char *replacement)
+uint64_t replace_span(const char *data, size_t length, const replace_options *options, long first_line,
+                      uint64_t limit, text_buffer *output)
 {
-    const char *wildcard_pos = strchr(search_text, '*');
-    int prefix_search = (wildcard_pos == search_text + strlen(search_text) - 1);
-    int suffix_search = (wildcard_pos == search_text);
-    char buffer[1024];
-    char *output = buffer;
-    char *word_start = line;
-    char *word_end;
+    const char *end = data + length;
+    long lines = first_line;
+    uint64_t replacements = 0;
+
+    while (data < end)
+    {
+        const char *newline = memchr(data, '\n', end - data);
+        const char *line_end = newline ? newline + 1 : end;
+
+        uint64_t left = limit - replacements;
+        if (left == 0)
+        {
+            buffer_append(output, data, end - data); // Limit reached, the rest goes out as is
+            break;
+        }
 
-    while (*word_start)
+        if (lines >= options->minimum && lines <= options->maximum)
+            replacements += replace_line(data, line_end - data, options, left, output);
+        else
+            buffer_append(output, data, line_end - data);
+
+        data = line_end;
+        lines++;
+    }
+
+    if (options->stats)
     {
-        copy_non_word_characters(&output, &word_start);
+        options->stats->lines += lines - first_line;
+        options->stats->replacements += replacements;
+    }
+    return replacements;
+}
+
+/**
+ * @brief Copies the rest of the input to the output once --max-count is reached, inside the kernel
+ *
+ * @param fptr Input file
+ * @param optr Output file
+ * @param options Replacement options
+ * @param offset Offset of the first byte not yet written
+ * @param stop Offset at which to stop, -1 for the end of the input
+ * @return int 0 if the rest was copied, -1 if the input is not a regular file and must be streamed
+ */
+static int copy_rest(FILE *fptr, FILE *optr, const replace_options *options, off_t offset, off_t stop)
+{
+    struct stat st;
+    if (fstat(fileno(fptr), &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    if (stop < 0 || stop > st.st_size)
+        stop = st.st_size;
+
+    fflush(optr);
+    if (copy_range(fileno(fptr), offset, stop - offset, fileno(optr)) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    update_progress(options->progress, stop - offset, 0, 0);
+    if (options->stats)
+        options->stats->bytes_copied += stop - offset;
+    return 0;
+}
 
-        if (*word_start == '\0')
-            break; // End of line
+/**
+ * @brief Copies lines from input to output, replacing the ones inside the line range
+ *
+ * @param fptr Input file, positioned at the start of line first_line
+ * @param optr Output file
+ * @param options Replacement options
+ * @param first_line Number of the line fptr is positioned at
+ * @param stop Offset at which to stop reading, -1 to read until EOF
+ */
+void process_lines(FILE *fptr, FILE *optr, const replace_options *options, long first_line, off_t stop)
+{
+    // Read the file line by line
+    char *bfr = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    text_buffer replaced = {NULL, 0, 0};
+    long lines = first_line;
+    uint64_t replacements = 0;
+    off_t offset = ftello(fptr);
+    off_t reported_offset = offset;
+    uint64_t reported_replacements = 0;
+
+    diff_writer diff;
+    if (options->diff != DIFF_NONE)
+        diff_begin(&diff, optr, options);
 
-        word_end = word_start;
-        while (*word_end && !is_word_boundary(*word_end))
+    range_cursor ranges;
+    if (options->range)
+        start_ranges(&ranges, options->range);
+
+    while ((stop < 0 || offset < stop) && (length = getline(&bfr, &capacity, fptr)) != -1)
+    {
+        long spanned = 1;
+        if (options->field)
         {
-            word_end++;
+            // A quoted field may hold newlines, so a record can span several lines
+            length = join_record(fptr, &bfr, &capacity, length);
+            spanned = count_newlines(bfr, length) + (bfr[length - 1] != '\n');
         }
 
-        char temp = temporarily_terminate_word(word_end);
+        uint64_t left = replacements_left(options, replacements);
+        if (left == 0 && options->diff == DIFF_NONE && copy_rest(fptr, optr, options, offset, stop) == 0)
+            break;
+
+        int count = 0;
+        if (left > 0 && lines >= options->minimum && lines <= options->maximum &&
+            (!options->range || line_in_range(&ranges, bfr, length, lines)))
+        {
+            replaced.length = 0;
+            count = replace_line(bfr, length, options, left, &replaced);
+            replacements += count;
+        }
 
-        if ((prefix_search && match_prefix(word_start, search_text)) ||
-            (suffix_search && match_suffix(word_start, search_text)))
+        if (options->diff != DIFF_NONE)
         {
-            perform_replacement(&output, word_start, replacement);
+            if (count)
+                diff_line(&diff, lines, offset, bfr, length, replaced.data, replaced.length);
+            else
+                diff_line(&diff, lines, offset, bfr, length, bfr, length);
+        }
+        else if (count)
+        {
+            fwrite(replaced.data, 1, replaced.length, optr);
         }
         else
         {
-            output += sprintf(output, "%s", word_start); // Copy word unchanged
+            fwrite(bfr, 1, length, optr);
         }
 
-        restore_original_character(word_end, temp);
-        word_start = word_end; // Move to the next word
+        offset += length;
+        lines += spanned;
+
+        // Publish progress once per chunk so the counters cost nothing per line
+        if (options->progress && offset - reported_offset >= COPY_CHUNK)
+        {
+            update_progress(options->progress, offset - reported_offset, lines, replacements - reported_replacements);
+            reported_offset = offset;
+            reported_replacements = replacements;
+        }
     }
+    update_progress(options->progress, offset - reported_offset, lines, replacements - reported_replacements);
+
+    if (options->diff != DIFF_NONE)
+        diff_end(&diff);
+
+    free(bfr);
+    free(replaced.data);
 
-    *output = '\0';       // Null-terminate the buffer
-    strcpy(line, buffer); // Now, copy the modified line back to the original line buffer
+    if (options->stats)
+    {
+        options->stats->lines += lines - first_line;
+        options->stats->replacements += replacements;
+    }
 }
 
 /**
- * @brief Normal replacing a specific word with a particular word
+ * @brief Jumps straight to the line range, copying the rest untouched
  *
- * @param source Line
- * @param substring Substring to checl
- * @param with Word to replace with
- * @return char* The string after the word is replaced
+ * The range is found with the .lidx sidecar when one is wanted, and otherwise with one pass of
+ * the newline kernel over the bytes before it.
+ *
+ * @param inputFile Name of the input file
+ * @param fptr Input file
+ * @param optr Output file
+ * @param options Replacement options
+ * @param useIndex Whether to use the .lidx sidecar
+ * @return int 0 if the range was processed, -1 if it could not be located
  */
-char *string_replace(char *source, char *substring, char *with)
+int process_range(const char *inputFile, FILE *fptr, FILE *optr, const replace_options *options, int useIndex)
 {
-    char *substring_source = strstr(source, substring);
-    if (substring_source == NULL)
+    int in_fd = fileno(fptr);
+    int out_fd = fileno(optr);
+    off_t start;
+    off_t end;
+    off_t size;
+    line_index index;
+    struct stat st;
+
+    if (useIndex && load_line_index(inputFile, &index) == 0)
     {
-        return NULL;
+        start = locate_line(in_fd, &index, options->minimum);
+        end = locate_line(in_fd, &index, line_after(options->maximum));
+        size = index.size;
+        free_line_index(&index);
+    }
+    else
+    {
+        // Pipes and devices are read as a stream instead, and so are diffs, for their context lines
+        if (options->diff != DIFF_NONE || fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode))
+            return -1;
+        start = skip_lines(in_fd, 0, options->minimum - 1);
+        end = start < 0 ? -1 : skip_lines(in_fd, start, options->maximum - options->minimum + 1);
+        size = st.st_size;
     }
 
-    memmove(
-        substring_source + strlen(with),
-        substring_source + strlen(substring),
-        strlen(substring_source) - strlen(substring) + 1);
+    if (start < 0 || end < 0 || fseeko(fptr, start, SEEK_SET) != 0)
+        return -1;
+
+    // Untouched prefix, edited range, then untouched suffix; a diff only needs the range
+    if (options->diff != DIFF_NONE)
+    {
+        update_progress(options->progress, start, options->minimum, 0);
+        process_lines(fptr, optr, options, options->minimum, end);
+        update_progress(options->progress, size - end, line_after(options->maximum), 0);
+        return 0;
+    }
+
+    if (copy_range(in_fd, 0, start, out_fd) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    update_progress(options->progress, start, options->minimum, 0);
+
+    process_lines(fptr, optr, options, options->minimum, end);
+    fflush(optr);
 
-    memcpy(substring_source, with, strlen(with));
-    return substring_source + strlen(with);
+    if (copy_range(in_fd, end, size - end, out_fd) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    update_progress(options->progress, size - end, line_after(options->maximum), 0);
+
+    if (options->stats)
+        options->stats->bytes_copied += start + (size - end);
+    return 0;
+}
+
+/**
+ * @brief Opens a temporary file next to the input that will replace it once fully written
+ *
+ * @param inputFile Name of the input file
+ * @param tempFile Receives the newly allocated name of the temporary file
+ * @return FILE* Temporary output file, NULL on failure
+ */
+FILE *open_in_place_output(const char *inputFile, char **tempFile)
+{
+    size_t length = strlen(inputFile) + sizeof(".XXXXXX");
+    *tempFile = malloc(length);
+    if (!*tempFile)
+        return NULL;
+    snprintf(*tempFile, length, "%s.XXXXXX", inputFile);
+
+    int fd = mkstemp(*tempFile);
+    if (fd < 0)
+        return NULL;
+
+    // Keep the permissions of the file being replaced
+    struct stat st;
+    if (stat(inputFile, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+
+    FILE *optr = fdopen(fd, "w");
+    if (!optr)
+    {
+        close(fd);
+        unlink(*tempFile);
+    }
+    return optr;
 }
 
 int main(int argc, char *argv[])
@@ -235,11 +596,74 @@ int main(int argc, char *argv[])
     char *inputFile = NULL;
     char *outputFile = NULL;
     long longArguments[2] = {0};
+    address_range addressRange;
+    int addressed = 0;
+    int useIndex = 0;
+    int inPlace = 0;
+    int useJournal = 0;
+    int watch = 0;
+    char *socketPath = NULL;
+    int showStats = 0;
+    int binaryMode = BINARY_PASS;
+    int diffFormat = DIFF_NONE;
+    int wholeWord = 0;
+    long progressInterval = 0;
+    char *progressEnd;
+    char *rulesFile = NULL;
+    char *mapFile = NULL;
+    long shardIndex = 0;
+    long shardCount = 0;
+    char *cacheDir = NULL;
+    long maxCount = 0;
+    char *maxCountEnd;
+    long field = 0;
+    char *fieldEnd;
+    const char *delimiter = NULL;
+    long fuzzyEdits = 0;
+    char *fuzzyEnd;
+
+    static struct option longOptions[] = {
+        {"index", no_argument, NULL, INDEX_OPTION},
+        {"in-place", no_argument, NULL, IN_PLACE_OPTION},
+        {"journal", no_argument, NULL, JOURNAL_OPTION},
+        {"watch", no_argument, NULL, WATCH_OPTION},
+        {"client", required_argument, NULL, CLIENT_OPTION},
+        {"stats", no_argument, NULL, STATS_OPTION},
+        {"binary", required_argument, NULL, BINARY_OPTION},
+        {"diff", optional_argument, NULL, DIFF_OPTION},
+        {"word", no_argument, NULL, WORD_OPTION},
+        {"progress", required_argument, NULL, PROGRESS_OPTION},
+        {"rules", required_argument, NULL, RULES_OPTION},
+        {"shard", required_argument, NULL, SHARD_OPTION},
+        {"cache", required_argument, NULL, CACHE_OPTION},
+        {"max-count", required_argument, NULL, MAX_COUNT_OPTION},
+        {"field", required_argument, NULL, FIELD_OPTION},
+        {"delim", required_argument, NULL, DELIM_OPTION},
+        {"fuzzy", required_argument, NULL, FUZZY_OPTION},
+        {"map", required_argument, NULL, MAP_OPTION},
+        {NULL, 0, NULL, 0}};
+
+    if (argc == 3 && strcmp(argv[1], "--daemon") == 0)
+        return run_daemon(argv[2]) == 0 ? 0 : OUTPUT_FILE_UNWRITABLE;
 
-    if (argc < 7)
+    if (argc >= 2 && strcmp(argv[1], "--merge-stats") == 0)
+        return merge_stats(argc - 2, argv + 2, stdout);
+
+    if (argc >= 2 && strcmp(argv[1], "compile") == 0)
+        return run_compile(argc - 2, argv + 2);
+
+    // A rules or map file may stand in for -s and -r; a silent first pass finds one in any spelling
+    // getopt_long() accepts, such as --rules=FILE, before the argument count is checked
+    int standIn = 0;
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, "s:r:l:", longOptions, NULL)) != -1)
+        standIn |= opt == RULES_OPTION || opt == MAP_OPTION;
+    if (argc < 7 && !standIn)
         exit(MISSING_ARGUMENT);
+    optind = 0;
+    opterr = 1;
 
-    while ((opt = getopt(argc, argv, "s:r:l:")) != -1)
+    while ((opt = getopt_long(argc, argv, "s:r:l:", longOptions, NULL)) != -1)
     {
         switch (opt)
         {
@@ -263,6 +687,14 @@ int main(int argc, char *argv[])
             if (optarg[0] == '-')
                 exit(L_ARGUMENT_INVALID);
             lValue = optarg;
+            if (strchr(lValue, '/'))
+            {
+                // Marker addresses are found while scanning, so nothing is numbered up front
+                if (parse_range(lValue, &addressRange) != 0)
+                    exit(L_ARGUMENT_INVALID);
+                addressed = 1;
+                break;
+            }
             char *token = strtok(lValue, ",");
             int counter = 0;
             while (token != NULL && counter < 2)
@@ -281,16 +713,102 @@ int main(int argc, char *argv[])
                 exit(L_ARGUMENT_INVALID);
             }
             break;
+        case INDEX_OPTION:
+            useIndex = 1;
+            break;
+        case IN_PLACE_OPTION:
+            inPlace = 1;
+            break;
+        case JOURNAL_OPTION:
+            useJournal = 1;
+            break;
+        case WATCH_OPTION:
+            watch = 1;
+            break;
+        case CLIENT_OPTION:
+            socketPath = optarg;
+            break;
+        case STATS_OPTION:
+            showStats = 1;
+            break;
+        case BINARY_OPTION:
+            if (strcmp(optarg, "pass") == 0)
+                binaryMode = BINARY_PASS;
+            else if (strcmp(optarg, "skip") == 0)
+                binaryMode = BINARY_SKIP;
+            else if (strcmp(optarg, "text") == 0)
+                binaryMode = BINARY_TEXT;
+            else
+                exit(MISSING_ARGUMENT);
+            break;
+        case PROGRESS_OPTION:
+            progressInterval = strtol(optarg, &progressEnd, 10);
+            if (progressEnd == optarg || *progressEnd != '\0' || progressInterval <= 0 || progressInterval > INT_MAX)
+                exit(MISSING_ARGUMENT);
+            break;
+        case RULES_OPTION:
+            if (rulesFile)
+                exit(DUPLICATE_ARGUMENT);
+            rulesFile = optarg;
+            break;
+        case MAP_OPTION:
+            if (mapFile)
+                exit(DUPLICATE_ARGUMENT);
+            mapFile = optarg;
+            break;
+        case SHARD_OPTION:
+            if (sscanf(optarg, "%ld/%ld", &shardIndex, &shardCount) != 2 ||
+                shardCount < 1 || shardIndex < 1 || shardIndex > shardCount)
+                exit(MISSING_ARGUMENT);
+            break;
+        case CACHE_OPTION:
+            cacheDir = optarg;
+            break;
+        case MAX_COUNT_OPTION:
+            maxCount = strtol(optarg, &maxCountEnd, 10);
+            if (maxCountEnd == optarg || *maxCountEnd != '\0' || maxCount <= 0 || maxCount == LONG_MAX)
+                exit(MISSING_ARGUMENT);
+            break;
+        case FIELD_OPTION:
+            field = strtol(optarg, &fieldEnd, 10);
+            if (fieldEnd == optarg || *fieldEnd != '\0' || field <= 0 || field > INT_MAX)
+                exit(MISSING_ARGUMENT);
+            break;
+        case DELIM_OPTION:
+            // A tab is hard to pass through some shells, so "\t" and "tab" stand for it
+            if (strcmp(optarg, "\\t") == 0 || strcmp(optarg, "tab") == 0)
+                delimiter = "\t";
+            else if (strlen(optarg) == 1 && strchr("\"\r\n", optarg[0]) == NULL)
+                delimiter = optarg;
+            else
+                exit(MISSING_ARGUMENT);
+            break;
+        case FUZZY_OPTION:
+            fuzzyEdits = strtol(optarg, &fuzzyEnd, 10);
+            if (fuzzyEnd == optarg || *fuzzyEnd != '\0' || fuzzyEdits <= 0 || fuzzyEdits > INT_MAX)
+                exit(MISSING_ARGUMENT);
+            break;
+        case WORD_OPTION:
+            wholeWord = 1;
+            break;
+        case DIFF_OPTION:
+            if (!optarg || strcmp(optarg, "unified") == 0)
+                diffFormat = DIFF_UNIFIED;
+            else if (strcmp(optarg, "patch") == 0)
+                diffFormat = DIFF_PATCH;
+            else
+                exit(MISSING_ARGUMENT);
+            break;
         default:
             // Handle unexpected options and ignoring
             break;
         }
     }
 
-    // Check for the mandatory arguments (-s and -r)
-    if (!sArguments)
+    // Check for the mandatory arguments (-s and -r), which go together when a rules or map file is given
+    if (!sArguments && ((!rulesFile && !mapFile) || rArguments))
         exit(S_ARGUMENT_MISSING);
-    if (!rArguments)
+    if (!rArguments && ((!rulesFile && !mapFile) || sArguments))
         exit(R_ARGUMENT_MISSING);
 
     if (optind < argc)
@@ -303,111 +821,287 @@ int main(int argc, char *argv[])
     }
 
     // Check for the filenames
-    if (!inputFile || !outputFile)
+    if (!inputFile || (!outputFile && !inPlace) || (watch && (inPlace || maxCount || field || addressed)) || (delimiter && !field) ||
+        (field && lValue) ||
+        (useJournal && !inPlace) || (fuzzyEdits && (rulesFile || mapFile)) || (mapFile && rulesFile) ||
+        (diffFormat != DIFF_NONE && (inPlace || watch)) ||
+        (shardCount && (inPlace || watch || diffFormat != DIFF_NONE)))
     {
         exit(MISSING_ARGUMENT);
     }
 
+    // Hand plain runs to a daemon when one is configured, falling back to a local run
+    if (!socketPath)
+        socketPath = getenv(SOCKET_ENVIRONMENT);
+    if (socketPath && !inPlace && !watch && !useIndex && !showStats && diffFormat == DIFF_NONE && !shardCount && !cacheDir && !maxCount && !field && !addressed)
+    {
+        replace_options request = {.search = sArguments,
+                                   .replace = rArguments,
+                                   .wildcard = contains(argc, argv, "-w"),
+                                   .minimum = -1,
+                                   .maximum = LONG_MAX,
+                                   .diff = DIFF_NONE,
+                                   .whole_word = wholeWord};
+        if (contains(argc, argv, "-l") == 1)
+        {
+            request.minimum = longArguments[0];
+            request.maximum = longArguments[1];
+        }
+
+        int status = run_client(socketPath, &request, binaryMode, rulesFile, mapFile, fuzzyEdits, inputFile, outputFile);
+        if (status >= 0)
+            return status;
+    }
+
     FILE *fptr = fopen(inputFile, "r");
     if (fptr == NULL)
     {
         exit(INPUT_FILE_MISSING);
     }
 
-    FILE *optr = fopen(outputFile, "w");
-    if (optr == NULL)
+    // Keep binaries away from the line-based engine, which stops at embedded NULs; a skipped binary
+    // leaves the output as it was, so the input is sniffed before the output is opened. Watch mode and
+    // shards sniff every version or file they process themselves
+    int binary = !watch && !shardCount && binaryMode != BINARY_TEXT && sniff_file(fileno(fptr)) == FILE_BINARY;
+
+    FILE *optr = NULL;
+    char *tempFile = NULL;
+    if (inPlace)
     {
-        exit(OUTPUT_FILE_UNWRITABLE);
+        if (access(inputFile, W_OK) != 0)
+            exit(OUTPUT_FILE_UNWRITABLE);
     }
 
+    replace_options options = {.search = sArguments,
+                               .replace = rArguments,
+                               .minimum = -1,
+                               .maximum = LONG_MAX,
+                               .diff = diffFormat,
+                               .label = inputFile,
+                               .whole_word = wholeWord,
+                               .max_count = maxCount,
+                               .field = (int)field,
+                               .delimiter = delimiter ? delimiter[0] : ','};
+
     // WildCard_Error
-    if (contains(argc, argv, "-w") == 1)
+    rule_set rules;
+    word_map map;
+    if (rulesFile)
     {
-        int lengthOfsArgument = strlen(sArguments);
+        // Rules are wildcards; -s and -r, when given, make the first rule unless the file is compiled
+        int status = open_rules(&rules, rulesFile, sArguments, rArguments);
+        if (status != 0)
+            exit(status);
 
-        if (sArguments[0] != '*' && sArguments[lengthOfsArgument - 1] != '*')
-            exit(WILDCARD_INVALID);
+        options.search = sArguments ? sArguments : "";
+        options.replace = rArguments ? rArguments : "";
+        options.wildcard = 1;
+        options.rules = &rules;
+    }
+    else if (mapFile)
+    {
+        // Whole words renamed through a perfect hash; -s and -r, when given, make the first entry unless
+        // the file is compiled
+        int status = open_map(&map, mapFile, sArguments, rArguments);
+        if (status != 0)
+            exit(status);
 
-        if (sArguments[0] == '*' && sArguments[lengthOfsArgument - 1] == '*')
+        options.search = sArguments ? sArguments : "";
+        options.replace = rArguments ? rArguments : "";
+        options.map = &map;
+    }
+    else
+    {
+        options.wildcard = contains(argc, argv, "-w");
+        if (compile_pattern(&options) != 0)
             exit(WILDCARD_INVALID);
+    }
 
-        if (sArguments[0] != '*')
-        {
-            // Read the file line by line
-            char bfr[1000] = {0};
-            int lines = 1;
-            int minimum = -1;
-            int maximum = countLines(inputFile) + 1;
+    // Approximate matching of a literal; within k edits, a search text of k bytes would match anywhere
+    fuzzy_pattern fuzzy;
+    if (fuzzyEdits)
+    {
+        if (options.wildcard || (size_t)fuzzyEdits >= options.search_length)
+            exit(MISSING_ARGUMENT);
+        compile_fuzzy(&fuzzy, options.search, options.search_length, (int)fuzzyEdits);
+        options.fuzzy = &fuzzy;
+    }
 
-            if (contains(argc, argv, "-l") == 1)
-            {
-                minimum = longArguments[0];
-                maximum = longArguments[1];
-            }
+    if (addressed)
+    {
+        options.range = &addressRange;
+    }
+    else if (contains(argc, argv, "-l") == 1)
+    {
+        options.minimum = longArguments[0];
+        options.maximum = longArguments[1];
+    }
 
-            while (fgets(bfr, 1000, fptr) != NULL)
-            {
-                if (lines >= minimum && lines <= maximum)
-                {
-                    wildcard_replace(bfr, sArguments, rArguments);
-                }
+    replace_stats stats;
+    start_stats(&stats, inputFile);
+    if (showStats || cacheDir)
+        options.stats = &stats;
 
-                fputs(bfr, optr);
-                lines++;
-            }
-            fclose(optr);
-        }
+    // Results are cached per input and per set of options; diffs and watch mode do not use the cache
+    int cacheable = cacheDir && !watch && diffFormat == DIFF_NONE;
+    if (cacheable)
+    {
+        options.cache = cacheDir;
+        options.cache_spec = options_digest(&options, binaryMode);
+    }
 
-        else
-        {
-            // Read the file line by line
-            char bfr[1000] = {0};
-            int lines = 1;
-            int minimum = -1;
-            int maximum = countLines(inputFile) + 1;
+    // A shard writes its share of a tree under the output directory and its stats fragment to stdout
+    if (shardCount)
+    {
+        fclose(fptr);
+        int status = run_shard(inputFile, outputFile, stdout, &options, shardIndex, shardCount, binaryMode);
+        if (rulesFile)
+            free_rules(&rules);
+        if (mapFile)
+            free_map(&map);
+        if (fuzzyEdits)
+            free_fuzzy(&fuzzy);
+        return status;
+    }
 
-            if (contains(argc, argv, "-l") == 1)
-            {
-                minimum = longArguments[0];
-                maximum = longArguments[1];
-            }
+    // A cached result whose output is already in place is left as it is, so the cache is looked up
+    // before the output is opened, which would truncate it
+    cache_result cached;
+    int cacheHit = 0;
+    if (cacheable && !binary)
+    {
+        cacheHit = cache_lookup(&options, inputFile, fileno(fptr), &cached);
+        cacheable = cacheHit >= 0;
+    }
+    int upToDate = cacheHit == 1 && (inPlace ? cached.kind == CACHE_NO_MATCH : cache_output_matches(outputFile, &cached));
 
-            while (fgets(bfr, 1000, fptr) != NULL)
-            {
-                if (lines >= minimum && lines <= maximum)
-                    wildcard_replace(bfr, sArguments, rArguments);
+    if (!inPlace && !watch && !upToDate && !(binary && binaryMode == BINARY_SKIP))
+    {
+        optr = fopen(outputFile, "w");
+        if (optr == NULL)
+        {
+            exit(OUTPUT_FILE_UNWRITABLE);
+        }
+    }
 
-                fputs(bfr, optr);
-                lines++;
-            }
-            fclose(optr);
+    // A passed binary is copied as it is; nothing of it changes, so its diff is empty
+    if (binary)
+    {
+        stats.binary = FILE_BINARY;
+        if (optr && binaryMode == BINARY_PASS && diffFormat == DIFF_NONE)
+        {
+            struct stat st;
+            if (fstat(fileno(fptr), &st) != 0 || copy_range(fileno(fptr), 0, st.st_size, fileno(optr)) != 0)
+                exit(OUTPUT_FILE_UNWRITABLE);
+            stats.bytes_copied = st.st_size;
         }
+
+        fclose(fptr);
+        if (optr)
+            fclose(optr);
+        if (showStats)
+            print_stats(stderr, &stats);
+        return 0;
     }
-    else
+
+    if (watch)
     {
-        // Read the file line by line
-        char bfr[1000] = {0};
-        int lines = 1;
-        int minimum = -1;
-        int maximum = countLines(inputFile) + 1;
+        fclose(fptr);
+        return watch_and_replace(inputFile, outputFile, &options, binaryMode) == 0 ? 0 : OUTPUT_FILE_UNWRITABLE;
+    }
 
-        if (contains(argc, argv, "-l") == 1)
+    // Inputs a previous run found nothing to replace in are copied without running the engine
+    if (upToDate || (cacheHit == 1 && cached.kind == CACHE_NO_MATCH))
+    {
+        stats.cache_hits++;
+        if (optr)
         {
-            minimum = longArguments[0];
-            maximum = longArguments[1];
+            if (copy_range(fileno(fptr), 0, cached.output_length, fileno(optr)) != 0 || fclose(optr) != 0)
+                exit(OUTPUT_FILE_UNWRITABLE);
+            stats.bytes_copied += cached.output_length;
         }
+        fclose(fptr);
+        if (rulesFile)
+            free_rules(&rules);
+        if (mapFile)
+            free_map(&map);
+        if (fuzzyEdits)
+            free_fuzzy(&fuzzy);
+        if (showStats)
+            print_stats(stderr, &stats);
+        return 0;
+    }
 
-        while (fgets(bfr, 1000, fptr) != NULL)
-        {
-            if (lines >= minimum && lines <= maximum)
-            {
-                while (string_replace(bfr, sArguments, rArguments))
-                    ;
-            }
+    // Report progress on SIGUSR1, and every progressInterval seconds with --progress
+    progress_counter progress;
+    struct stat inputStat;
+    if (fstat(fileno(fptr), &inputStat) == 0 && start_progress(&progress, inputStat.st_size, progressInterval) == 0)
+        options.progress = &progress;
 
-            fputs(bfr, optr);
-            lines++;
+    if (inPlace)
+    {
+        // Same-length literal swaps only touch the matched bytes
+        if (can_patch_in_place(&options))
+        {
+            if (patch_in_place(inputFile, &options, useIndex, useJournal) != 0)
+                exit(OUTPUT_FILE_UNWRITABLE);
+            if (cacheable && stats.replacements == 0)
+                cache_finish(&options, inputFile, fileno(fptr), inputFile, &cached, 0);
+            fclose(fptr);
+            if (options.progress)
+                stop_progress(&progress);
+            if (showStats)
+                print_stats(stderr, &stats);
+            return 0;
         }
-        fclose(optr);
+
+        optr = open_in_place_output(inputFile, &tempFile);
+        if (optr == NULL)
+            exit(OUTPUT_FILE_UNWRITABLE);
     }
+
+    if (contains(argc, argv, "-l") == 1 && !addressed)
+    {
+        if (process_range(inputFile, fptr, optr, &options, useIndex) != 0)
+            process_lines(fptr, optr, &options, 1, -1);
+    }
+    else if (run_plan(fptr, optr, &options) != 0)
+    {
+        process_lines(fptr, optr, &options, 1, -1);
+    }
+
+    if (fclose(optr) != 0)
+    {
+        if (tempFile)
+            unlink(tempFile);
+        exit(OUTPUT_FILE_UNWRITABLE);
+    }
+
+    // An in-place run that replaced something leaves a different file, so only a miss is worth caching
+    if (cacheable && (!tempFile || stats.replacements == 0))
+        cache_finish(&options, inputFile, fileno(fptr), outputFile, &cached, stats.replacements);
+    fclose(fptr);
+
+    // Leave an input without matches untouched rather than swapping in an identical copy
+    if (tempFile && options.stats && options.stats->replacements == 0)
+    {
+        unlink(tempFile);
+    }
+    else if (tempFile && rename(tempFile, inputFile) != 0)
+    {
+        unlink(tempFile);
+        exit(OUTPUT_FILE_UNWRITABLE);
+    }
+    free(tempFile);
+    if (rulesFile)
+        free_rules(&rules);
+    if (mapFile)
+        free_map(&map);
+    if (fuzzyEdits)
+        free_fuzzy(&fuzzy);
+
+    if (options.progress)
+        stop_progress(&progress);
+    if (showStats)
+        print_stats(stderr, &stats);
 }
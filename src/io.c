@@ -0,0 +1,160 @@
+#include "hw5.h"
+
+/**
+ * @brief Folds a block of bytes into a running FNV-1a hash
+ *
+ * @param hash Hash so far, FNV_OFFSET_BASIS to start a new one
+ * @param data Bytes to add
+ * @param length Number of bytes
+ * @return uint64_t Updated hash
+ */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Writes a buffer at an offset, retrying short writes
+ *
+ * @param fd Descriptor to write to
+ * @param data Bytes to write
+ * @param length Number of bytes
+ * @param offset Offset in the file
+ * @return int 0 on success, -1 on failure
+ */
+int pwrite_all(int fd, const void *data, size_t length, off_t offset)
+{
+    const char *bytes = data;
+    while (length > 0)
+    {
+        ssize_t put = pwrite(fd, bytes, length, offset);
+        if (put < 0)
+            return -1;
+        bytes += put;
+        length -= put;
+        offset += put;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies a byte range of one file to the current position of another, inside the kernel when possible
+ *
+ * @param in_fd Descriptor to copy from
+ * @param offset Offset of the range in in_fd
+ * @param length Number of bytes to copy
+ * @param out_fd Descriptor to append to
+ * @return int 0 on success, -1 on failure
+ */
+int copy_range(int in_fd, off_t offset, off_t length, int out_fd)
+{
+    while (length > 0)
+    {
+        ssize_t copied = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+        if (copied <= 0)
+            break; // Not supported between these files, fall back to read/write
+        length -= copied;
+    }
+
+    char buffer[COPY_CHUNK];
+    while (length > 0)
+    {
+        ssize_t got = pread(in_fd, buffer, length < COPY_CHUNK ? length : COPY_CHUNK, offset);
+        if (got <= 0)
+            return -1;
+
+        for (ssize_t written = 0; written < got;)
+        {
+            ssize_t put = write(out_fd, buffer + written, got - written);
+            if (put < 0)
+                return -1;
+            written += put;
+        }
+        offset += got;
+        length -= got;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads the whole lines starting at an offset, as many as fit in the buffer
+ *
+ * @param fd Descriptor of the input
+ * @param position Offset to read at, the start of a line
+ * @param size Size of the input
+ * @param buffer Read buffer, grown when a single line does not fit
+ * @param capacity Capacity of the buffer, updated
+ * @return ssize_t Length of the lines read, the rest of the input if it has no newline, -1 on a read error
+ */
+ssize_t read_lines(int fd, off_t position, off_t size, char **buffer, size_t *capacity)
+{
+    for (;;)
+    {
+        size_t wanted = (off_t)*capacity < size - position ? *capacity : (size_t)(size - position);
+        ssize_t got = pread(fd, *buffer, wanted, position);
+        if (got < 0)
+            return -1;
+        if ((size_t)got < wanted || position + got == size)
+            return got; // The last line of the input, with or without its newline
+
+        const char *newline = memrchr(*buffer, '\n', got);
+        if (newline)
+            return newline - *buffer + 1;
+
+        char *grown = realloc(*buffer, *capacity * 2);
+        if (!grown)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *buffer = grown;
+        *capacity *= 2;
+    }
+}
+
+/**
+ * @brief Makes room for more bytes (plus a terminating NUL) at the end of a buffer
+ *
+ * @param buffer Buffer to grow
+ * @param extra Number of bytes about to be appended
+ */
+void buffer_reserve(text_buffer *buffer, size_t extra)
+{
+    if (buffer->length + extra + 1 <= buffer->capacity)
+        return;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < buffer->length + extra + 1)
+        capacity *= 2;
+
+    char *grown = realloc(buffer->data, capacity);
+    if (!grown)
+    {
+        perror("Failed to grow buffer");
+        exit(EXIT_FAILURE);
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+}
+
+/**
+ * @brief Appends bytes to a buffer, keeping it NUL-terminated
+ *
+ * @param buffer Buffer to append to
+ * @param data Bytes to append
+ * @param length Number of bytes
+ */
+void buffer_append(text_buffer *buffer, const char *data, size_t length)
+{
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
@@ -0,0 +1,300 @@
+#include "hw5.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "HW5LIDX"
+#define INDEX_VERSION 1
+
+/**
+ * @brief On-disk header of a .lidx file, followed by `samples` 64-bit offsets
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t stride;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t samples;
+    uint64_t checksum;
+} lidx_header;
+
+/**
+ * @brief Computes the checksum of a header (with its checksum field zeroed) and its offsets
+ */
+static uint64_t index_checksum(lidx_header header, const uint64_t *offsets)
+{
+    header.checksum = 0;
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &header, sizeof(header));
+    return fnv1a(hash, offsets, header.samples * sizeof(uint64_t));
+}
+
+/**
+ * @brief Builds the path of the sidecar index of a file
+ *
+ * @param filename Name of the indexed file
+ * @param suffix Extra suffix appended after the index extension
+ * @return char* Newly allocated path, NULL on allocation failure
+ */
+static char *index_path(const char *filename, const char *suffix)
+{
+    size_t length = strlen(filename) + strlen(INDEX_EXTENSION) + strlen(suffix) + 1;
+    char *path = malloc(length);
+    if (path)
+    {
+        snprintf(path, length, "%s%s%s", filename, INDEX_EXTENSION, suffix);
+    }
+    return path;
+}
+
+/**
+ * @brief Reads the sidecar index and checks it still describes the file
+ *
+ * @param filename Name of the indexed file
+ * @param st Current status of the indexed file
+ * @param index Index to fill
+ * @return int 0 if a valid index was read, -1 otherwise
+ */
+static int read_index(const char *filename, const struct stat *st, line_index *index)
+{
+    char *path = index_path(filename, "");
+    if (!path)
+        return -1;
+
+    FILE *file = fopen(path, "rb");
+    free(path);
+    if (!file)
+        return -1;
+
+    lidx_header header;
+    uint64_t *offsets = NULL;
+    int result = -1;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_VERSION ||
+        header.stride == 0 ||
+        header.size != (uint64_t)st->st_size ||
+        header.mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+        header.mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+        header.samples == 0 ||
+        header.samples > header.lines / header.stride + 1)
+    {
+        goto done;
+    }
+
+    offsets = malloc(header.samples * sizeof(uint64_t));
+    if (!offsets || fread(offsets, sizeof(uint64_t), header.samples, file) != header.samples)
+        goto done;
+
+    if (index_checksum(header, offsets) != header.checksum)
+        goto done;
+
+    index->stride = header.stride;
+    index->size = header.size;
+    index->lines = header.lines;
+    index->samples = header.samples;
+    index->offsets = offsets;
+    offsets = NULL;
+    result = 0;
+
+done:
+    free(offsets);
+    fclose(file);
+    return result;
+}
+
+/**
+ * @brief Writes the sidecar index next to the file, replacing any stale one atomically
+ *
+ * @param filename Name of the indexed file
+ * @param st Status of the indexed file when it was scanned
+ * @param index Index to persist
+ */
+static void write_index(const char *filename, const struct stat *st, const line_index *index)
+{
+    char *path = index_path(filename, "");
+    char *temp = index_path(filename, ".tmp");
+    if (!path || !temp)
+        goto done;
+
+    lidx_header header = {0};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.stride = index->stride;
+    header.size = index->size;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.lines = index->lines;
+    header.samples = index->samples;
+    header.checksum = index_checksum(header, index->offsets);
+
+    // The index is only an accelerator, so failing to save it is not an error
+    FILE *file = fopen(temp, "wb");
+    if (!file)
+        goto done;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(index->offsets, sizeof(uint64_t), index->samples, file) == index->samples;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(temp, path) != 0)
+        unlink(temp);
+
+done:
+    free(path);
+    free(temp);
+}
+
+/**
+ * @brief Scans a file once, sampling the start offset of every INDEX_STRIDE-th line
+ *
+ * @param fd Open descriptor of the file
+ * @param index Index to fill
+ * @return int 0 on success, -1 on read or allocation failure
+ */
+static int build_index(int fd, line_index *index)
+{
+    size_t capacity = 64;
+    uint64_t *offsets = malloc(capacity * sizeof(uint64_t));
+    char *buffer = malloc(COPY_CHUNK);
+    if (!offsets || !buffer)
+        goto fail;
+
+    uint64_t samples = 0;
+    uint64_t remaining = INDEX_STRIDE; // Newlines left before the next sample
+    uint64_t position = 0;
+    char last = '\n';
+    ssize_t got;
+
+    offsets[samples++] = 0; // Line 1 always starts at the beginning
+
+    while ((got = pread(fd, buffer, COPY_CHUNK, position)) > 0)
+    {
+        const char *cursor = buffer;
+        const char *end = buffer + got;
+        const char *line;
+
+        while ((line = find_newline(cursor, end - cursor, &remaining)) != NULL)
+        {
+            if (samples == capacity)
+            {
+                capacity *= 2;
+                uint64_t *grown = realloc(offsets, capacity * sizeof(uint64_t));
+                if (!grown)
+                    goto fail;
+                offsets = grown;
+            }
+            offsets[samples++] = position + (line - buffer);
+            remaining = INDEX_STRIDE;
+            cursor = line;
+        }
+
+        last = buffer[got - 1];
+        position += got;
+    }
+
+    if (got < 0)
+        goto fail;
+
+    free(buffer);
+    index->stride = INDEX_STRIDE;
+    index->size = position;
+    index->lines = (samples - 1) * INDEX_STRIDE + (INDEX_STRIDE - remaining) + (position > 0 && last != '\n');
+    index->samples = samples;
+    index->offsets = offsets;
+    return 0;
+
+fail:
+    free(offsets);
+    free(buffer);
+    return -1;
+}
+
+/**
+ * @brief Loads the .lidx sidecar of a file, building and saving it when it is missing or stale
+ *
+ * @param filename Name of the file to index
+ * @param index Index to fill, release it with free_line_index()
+ * @return int 0 on success, -1 if the file could not be indexed
+ */
+int load_line_index(const char *filename, line_index *index)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    int result = -1;
+
+    if (fstat(fd, &st) != 0)
+        goto done;
+
+    if (read_index(filename, &st, index) == 0)
+    {
+        result = 0;
+        goto done;
+    }
+
+    if (build_index(fd, index) == 0)
+    {
+        write_index(filename, &st, index);
+        result = 0;
+    }
+
+done:
+    close(fd);
+    return result;
+}
+
+/**
+ * @brief Releases the offsets held by an index
+ *
+ * @param index Index to release
+ */
+void free_line_index(line_index *index)
+{
+    free(index->offsets);
+    index->offsets = NULL;
+    index->samples = 0;
+}
+
+/**
+ * @brief Number of the line after the last line of a range
+ *
+ * A range may end at LONG_MAX, which strtol() gives for any larger number, so the result
+ * saturates there instead of overflowing; no file has that many lines.
+ *
+ * @param maximum Last line of the range
+ * @return long maximum + 1, or LONG_MAX
+ */
+long line_after(long maximum)
+{
+    return maximum < LONG_MAX ? maximum + 1 : LONG_MAX;
+}
+
+/**
+ * @brief Finds the byte offset where a line starts, starting from the nearest sample
+ *
+ * @param fd Open descriptor of the indexed file
+ * @param index Index of the file
+ * @param line Line number, starting at 1
+ * @return off_t Offset of the line, the file size if the line is past the end, -1 on read failure
+ */
+off_t locate_line(int fd, const line_index *index, long line)
+{
+    if (line < 1)
+        line = 1;
+    if ((uint64_t)line > index->lines)
+        return index->size;
+
+    uint64_t sample = (uint64_t)(line - 1) / index->stride;
+    uint64_t remaining = (uint64_t)(line - 1) % index->stride;
+    uint64_t position = index->offsets[sample];
+
+    return skip_lines(fd, position, remaining);
+}
@@ -0,0 +1,127 @@
+#include "hw5.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Builds the mask of a byte in a 64-byte block, bit i set when byte i matches
+ *
+ * @param block SCAN_BLOCK bytes to compare
+ * @param byte Byte to look for
+ * @return uint64_t Mask of the matching bytes
+ */
+uint64_t byte_mask(const char *block, char byte)
+{
+#if defined(__SSE2__)
+    const __m128i wanted = _mm_set1_epi8(byte);
+    uint64_t mask = 0;
+    for (int i = 0; i < SCAN_BLOCK; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, wanted)) << i;
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < SCAN_BLOCK; i++)
+        mask |= (uint64_t)(block[i] == byte) << i;
+    return mask;
+#endif
+}
+
+/**
+ * @brief Counts the newlines in a block of memory, a 64-byte block per compare and popcount
+ *
+ * @param data Bytes to scan
+ * @param length Number of bytes
+ * @return uint64_t Number of '\n' bytes
+ */
+uint64_t count_newlines(const char *data, size_t length)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+
+    for (; i + SCAN_BLOCK <= length; i += SCAN_BLOCK)
+        count += __builtin_popcountll(byte_mask(data + i, '\n'));
+
+    for (; i < length; i++)
+        count += data[i] == '\n';
+    return count;
+}
+
+/**
+ * @brief Finds the end of the n-th line of a block of memory
+ *
+ * @param data Bytes to scan
+ * @param length Number of bytes
+ * @param remaining Number of newlines to pass, at least 1; reduced by the newlines passed when
+ * the block holds fewer
+ * @return const char* Byte after the remaining-th newline, NULL if the block holds fewer
+ */
+const char *find_newline(const char *data, size_t length, uint64_t *remaining)
+{
+    size_t i = 0;
+
+    for (; i + SCAN_BLOCK <= length; i += SCAN_BLOCK)
+    {
+        uint64_t mask = byte_mask(data + i, '\n');
+        uint64_t count = __builtin_popcountll(mask);
+        if (count < *remaining)
+        {
+            *remaining -= count;
+            continue;
+        }
+
+        // Drop the newlines before the wanted one, which is then the lowest bit left
+        for (uint64_t skipped = 1; skipped < *remaining; skipped++)
+            mask &= mask - 1;
+        *remaining = 0;
+        return data + i + __builtin_ctzll(mask) + 1;
+    }
+
+    for (; i < length; i++)
+    {
+        if (data[i] == '\n' && --*remaining == 0)
+            return data + i + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the offset of the line a number of lines after a given offset in a file
+ *
+ * @param fd Descriptor of the file
+ * @param start Offset to start at, the start of a line
+ * @param lines Number of lines to skip
+ * @return off_t Offset of the line after them, the end of the file if it has fewer, -1 on a read error
+ */
+off_t skip_lines(int fd, off_t start, uint64_t lines)
+{
+    if (lines == 0)
+        return start;
+
+    char *buffer = malloc(COPY_CHUNK);
+    if (!buffer)
+        return -1;
+
+    off_t position = start;
+    ssize_t got;
+    off_t result = -1;
+
+    while ((got = pread(fd, buffer, COPY_CHUNK, position)) > 0)
+    {
+        const char *line = find_newline(buffer, got, &lines);
+        if (line)
+        {
+            result = position + (line - buffer);
+            break;
+        }
+        position += got;
+    }
+
+    if (got == 0)
+        result = position;
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,404 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "HW5JRNL"
+
+/**
+ * @brief On-disk header of an undo journal, followed by the original text, the replacement text and
+ * `count` offsets
+ */
+typedef struct
+{
+    char magic[8];
+    uint64_t length;     // Length of the original (and replacement) text
+    uint64_t count;      // Number of patched offsets
+    uint64_t size;       // Size of the file when it was journaled
+    int64_t mtime_sec;   // Modification time of the file when it was journaled
+    int64_t mtime_nsec;
+    uint64_t checksum;   // FNV-1a of the header (checksum zeroed), both texts and offsets
+} journal_header;
+
+/**
+ * @brief Growable list of byte offsets
+ */
+typedef struct
+{
+    off_t *items;
+    size_t count;
+    size_t capacity;
+} offset_list;
+
+/**
+ * @brief Appends an offset to a list
+ *
+ * @return int 0 on success, -1 on allocation failure
+ */
+static int push_offset(offset_list *list, off_t offset)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        off_t *grown = realloc(list->items, capacity * sizeof(off_t));
+        if (!grown)
+            return -1;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = offset;
+    return 0;
+}
+
+/**
+ * @brief Computes the checksum stored in a journal header
+ */
+static uint64_t journal_checksum(journal_header header, const char *original, const char *replacement,
+                                 const off_t *offsets)
+{
+    header.checksum = 0;
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &header, sizeof(header));
+    hash = fnv1a(hash, original, header.length);
+    hash = fnv1a(hash, replacement, header.length);
+    return fnv1a(hash, offsets, header.count * sizeof(off_t));
+}
+
+/**
+ * @brief Builds the path of the undo journal of a file
+ *
+ * @param filename Name of the patched file
+ * @return char* Newly allocated path, NULL on allocation failure
+ */
+static char *journal_path(const char *filename)
+{
+    size_t length = strlen(filename) + strlen(JOURNAL_EXTENSION) + 1;
+    char *path = malloc(length);
+    if (path)
+    {
+        snprintf(path, length, "%s%s", filename, JOURNAL_EXTENSION);
+    }
+    return path;
+}
+
+/**
+ * @brief Records every offset about to be patched, with the text they held, and flushes it to disk
+ *
+ * @param path Path of the journal
+ * @param original Text currently at each offset
+ * @param replacement Text about to be written at each offset
+ * @param length Length of either text
+ * @param matches Offsets about to be patched
+ * @param st Status of the file before patching
+ * @return int 0 on success, -1 on failure
+ */
+static int write_journal(const char *path, const char *original, const char *replacement, size_t length,
+                         const offset_list *matches, const struct stat *st)
+{
+    journal_header header = {0};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.length = length;
+    header.count = matches->count;
+    header.size = st->st_size;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.checksum = journal_checksum(header, original, replacement, matches->items);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+
+    int ok = pwrite_all(fd, &header, sizeof(header), 0) == 0 &&
+             pwrite_all(fd, original, length, sizeof(header)) == 0 &&
+             pwrite_all(fd, replacement, length, sizeof(header) + length) == 0 &&
+             pwrite_all(fd, matches->items, matches->count * sizeof(off_t), sizeof(header) + 2 * length) == 0 &&
+             fsync(fd) == 0;
+    close(fd);
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Tells whether a journal still describes the file, so that undoing it cannot overwrite
+ * anything but the interrupted run's own patches
+ *
+ * Patching keeps the size and only moves the modification time forward, and each journaled offset
+ * holds either the original text or the replacement. A file edited since, by hand or by a run
+ * without a journal, fails one of these and keeps its bytes.
+ */
+static int journal_applies(int fd, const journal_header *header, const char *original, const char *replacement,
+                           const off_t *offsets, char *current)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != header->size || st.st_mtim.tv_sec < header->mtime_sec ||
+        (st.st_mtim.tv_sec == header->mtime_sec && st.st_mtim.tv_nsec < header->mtime_nsec))
+        return 0;
+
+    for (uint64_t i = 0; i < header->count; i++)
+    {
+        if (offsets[i] < 0 || (uint64_t)offsets[i] > header->size - header->length ||
+            pread(fd, current, header->length, offsets[i]) != (ssize_t)header->length ||
+            (memcmp(current, original, header->length) != 0 && memcmp(current, replacement, header->length) != 0))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Undoes an interrupted patch run by putting the journaled text back at every offset
+ *
+ * A journal whose checksum does not match was torn before patching began, and one that no longer
+ * applies to the file is stale; either is simply dropped.
+ *
+ * @param fd Descriptor of the patched file, open for writing
+ * @param path Path of the journal
+ * @return int 0 if there was nothing to undo or the undo succeeded, -1 on failure
+ */
+static int replay_journal(int fd, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return 0;
+
+    journal_header header;
+    char *original = NULL;
+    off_t *offsets = NULL;
+    int result = 0;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.length == 0 || header.length > SIZE_MAX / 4 || header.length > header.size ||
+        header.count > SIZE_MAX / sizeof(off_t))
+    {
+        goto done;
+    }
+
+    // The original text, the replacement, and room to read what each offset holds now
+    original = malloc(3 * header.length);
+    offsets = malloc(header.count ? header.count * sizeof(off_t) : 1);
+    if (!original || !offsets)
+    {
+        result = -1;
+        goto done;
+    }
+    char *replacement = original + header.length;
+
+    if (fread(original, 1, 2 * header.length, file) != 2 * header.length ||
+        fread(offsets, sizeof(off_t), header.count, file) != header.count ||
+        journal_checksum(header, original, replacement, offsets) != header.checksum ||
+        !journal_applies(fd, &header, original, replacement, offsets, replacement + header.length))
+    {
+        goto done;
+    }
+
+    for (uint64_t i = 0; i < header.count && result == 0; i++)
+    {
+        result = pwrite_all(fd, original, header.length, offsets[i]);
+    }
+    if (result == 0)
+        result = fsync(fd);
+
+done:
+    free(original);
+    free(offsets);
+    fclose(file);
+    if (result == 0)
+        unlink(path);
+    return result;
+}
+
+/**
+ * @brief Collects the offsets of every non-overlapping match inside the line range
+ *
+ * @param fd Descriptor of the file
+ * @param options Replacement options
+ * @param start Offset to start at, which is the start of line `line`
+ * @param stop Offset to stop at
+ * @param line Number of the line at start
+ * @param count_lines Whether line numbers must be tracked to honour the range
+ * @param matches List receiving the offsets
+ * @return int 0 on success, -1 on failure
+ */
+static int find_matches(int fd, const replace_options *options, off_t start, off_t stop, long line,
+                        int count_lines, offset_list *matches)
+{
+    size_t length = strlen(options->search);
+    char *buffer = malloc(COPY_CHUNK);
+    if (!buffer)
+        return -1;
+
+    off_t position = start;
+    off_t reported = start;
+    size_t reported_matches = matches->count;
+    int result = 0;
+
+    while (position < stop)
+    {
+        // Everything before the next read has been scanned
+        update_progress(options->progress, position - reported, count_lines ? line : 0, matches->count - reported_matches);
+        reported = position;
+        reported_matches = matches->count;
+
+        size_t wanted = stop - position < COPY_CHUNK ? (size_t)(stop - position) : COPY_CHUNK;
+        ssize_t got = pread(fd, buffer, wanted, position);
+        if (got < 0)
+        {
+            result = -1;
+            break;
+        }
+        if (got == 0)
+            break;
+
+        const char *end = buffer + got;
+        const char *cursor = buffer;
+        const char *counted = buffer;
+        const char *match;
+
+        while ((match = memmem(cursor, end - cursor, options->search, length)) != NULL)
+        {
+            if (count_lines)
+            {
+                line += count_newlines(counted, match - counted);
+                counted = match;
+            }
+
+            if (line > options->maximum)
+                goto done;
+
+            if (line >= options->minimum && push_offset(matches, position + (match - buffer)) != 0)
+            {
+                result = -1;
+                goto done;
+            }
+            if (replacements_left(options, matches->count) == 0)
+                goto done; // --max-count reached, the rest of the file stays as it is
+            cursor = match + length;
+        }
+
+        if ((size_t)got < wanted || position + got >= stop)
+            break;
+
+        // Keep the tail that may hold the start of a match split across two reads
+        const char *next = end - (length - 1);
+        if (next < cursor)
+            next = cursor;
+        if (next == buffer)
+            next = end; // A chunk shorter than the search text cannot make progress otherwise
+        if (count_lines)
+            line += count_newlines(counted, next - counted);
+        position += next - buffer;
+    }
+
+done:
+    update_progress(options->progress, stop - reported, count_lines ? line : 0, matches->count - reported_matches);
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Checks whether a run can be done by overwriting the matched bytes of the input directly
+ *
+ * @param options Replacement options
+ * @return int 1 for same-length substring replacements that cannot span lines, 0 otherwise
+ */
+int can_patch_in_place(const replace_options *options)
+{
+    size_t length = strlen(options->search);
+    return !options->wildcard && !options->whole_word && !options->field && !options->fuzzy && !options->map && !options->range && length > 0 && length == strlen(options->replace) &&
+           strchr(options->search, '\n') == NULL && strchr(options->replace, '\n') == NULL;
+}
+
+/**
+ * @brief Overwrites only the matched bytes of a file with pwrite(), leaving every other byte untouched
+ *
+ * @param filename Name of the file to patch
+ * @param options Replacement options, which must satisfy can_patch_in_place()
+ * @param useIndex Whether to jump to the line range through the .lidx sidecar
+ * @param journal Whether to write an undo journal before patching
+ * @return int 0 on success, -1 on failure
+ */
+int patch_in_place(const char *filename, const replace_options *options, int useIndex, int journal)
+{
+    int fd = open(filename, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    char *path = journal_path(filename);
+    offset_list matches = {0};
+    size_t length = strlen(options->search);
+    int result = -1;
+
+    // Roll back whatever an interrupted journaled run left half done; only a journaled run does, as
+    // the journal's promise is made to it
+    if (!path || (journal && replay_journal(fd, path) != 0))
+        goto done;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        goto done;
+
+    off_t start = 0;
+    off_t stop = st.st_size;
+    long line = 1;
+    int count_lines = options->minimum > 1 || options->maximum < LONG_MAX;
+
+    line_index index;
+    if (count_lines && useIndex && load_line_index(filename, &index) == 0)
+    {
+        start = locate_line(fd, &index, options->minimum);
+        stop = locate_line(fd, &index, line_after(options->maximum));
+        free_line_index(&index);
+        if (start < 0 || stop < 0)
+            goto done;
+        line = options->minimum;
+        count_lines = 0;
+    }
+    else if (count_lines)
+    {
+        // The newline kernel skips the lines before the range; find_matches() counts the ones inside it
+        start = skip_lines(fd, 0, options->minimum - 1);
+        if (start < 0)
+            goto done;
+        line = options->minimum;
+    }
+
+    if (find_matches(fd, options, start, stop, line, count_lines, &matches) != 0)
+        goto done;
+
+    if (options->stats)
+        options->stats->replacements += matches.count;
+
+    if (matches.count == 0)
+    {
+        result = 0;
+        goto done;
+    }
+
+    // A run without a journal makes its patches the file's content, so an older journal is dropped
+    // rather than left to undo them later
+    if (journal ? write_journal(path, options->search, options->replace, length, &matches, &st) != 0
+                : unlink(path) != 0 && errno != ENOENT)
+        goto done;
+
+    for (size_t i = 0; i < matches.count; i++)
+    {
+        if (pwrite_all(fd, options->replace, length, matches.items[i]) != 0)
+            goto done;
+    }
+
+    if (journal)
+    {
+        // The patch is durable once the file is synced, so the journal is no longer needed
+        if (fsync(fd) != 0)
+            goto done;
+        unlink(path);
+    }
+    result = 0;
+
+done:
+    free(matches.items);
+    free(path);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,558 @@
+#include "hw5.h"
+
+#include <limits.h>
+#include <sys/stat.h>
+
+#define PLAN_SAMPLES 8
+#define PLAN_SAMPLE_SIZE 16384
+#define PLAN_MIN_GAP 4096   // Fewer bytes between candidates than this and a copy per span costs too much
+#define PLAN_MAX_SCANNED 4  // Rewrite when over 1 / PLAN_MAX_SCANNED of the bytes would go through the engine
+
+/**
+ * @brief Literals one of which every match of the options contains, so text without them can be skipped
+ */
+typedef struct
+{
+    const char *literals[FUZZY_MAX_PIECES];
+    size_t lengths[FUZZY_MAX_PIECES];
+    const char *next[FUZZY_MAX_PIECES]; // Next occurrence of each literal in the buffer, NULL when not searched yet
+    size_t count;                        // 0 when the search text is empty and never matches
+} prefilter;
+
+/**
+ * @brief Sets up the prefilter of the options
+ *
+ * A single pattern has one literal; an approximate one has the pieces of which a match keeps one.
+ *
+ * @param filter Prefilter to fill in
+ * @param options Replacement options
+ * @return int 0 on success, -1 when there is no prefilter (rule sets, word maps, fuzzy patterns with many edits)
+ */
+static int start_prefilter(prefilter *filter, const replace_options *options)
+{
+    memset(filter, 0, sizeof(*filter));
+
+    if (options->rules || options->map)
+        return -1;
+
+    if (options->fuzzy)
+    {
+        const fuzzy_pattern *pattern = options->fuzzy;
+        if (!pattern->piece_count)
+            return -1;
+        for (size_t i = 0; i < pattern->piece_count; i++)
+        {
+            filter->literals[i] = pattern->text + pattern->pieces[i];
+            filter->lengths[i] = pattern->pieces[i + 1] - pattern->pieces[i];
+        }
+        filter->count = pattern->piece_count;
+        return 0;
+    }
+
+    if (options->wildcard)
+    {
+        // The affix of "prefix*" or "*suffix"
+        filter->lengths[0] = options->search_length - 1;
+        filter->literals[0] = options->search[0] == '*' ? options->search + 1 : options->search;
+    }
+    else
+    {
+        filter->lengths[0] = options->search_length;
+        filter->literals[0] = options->search;
+    }
+    filter->count = filter->lengths[0] > 0;
+    return 0;
+}
+
+/**
+ * @brief Forgets the occurrences found in the previous buffer
+ */
+static void rewind_prefilter(prefilter *filter)
+{
+    memset(filter->next, 0, sizeof(filter->next));
+}
+
+/**
+ * @brief Finds the next occurrence of any literal of the prefilter
+ *
+ * Each literal is only searched again once the cursor has passed its last occurrence, so several
+ * literals cost one scan each over the buffer.
+ *
+ * @param filter Prefilter, rewound since the buffer was last refilled
+ * @param cursor Where to search from
+ * @param end End of the buffer
+ * @param length Receives the length of the literal found
+ * @return const char* Earliest occurrence, NULL if none is left
+ */
+static const char *prefilter_next(prefilter *filter, const char *cursor, const char *end, size_t *length)
+{
+    const char *first = NULL;
+
+    for (size_t i = 0; i < filter->count; i++)
+    {
+        if (!filter->next[i] || filter->next[i] < cursor)
+        {
+            const char *hit = memmem(cursor, end - cursor, filter->literals[i], filter->lengths[i]);
+            filter->next[i] = hit ? hit : end;
+        }
+        if (filter->next[i] < end && (!first || filter->next[i] < first))
+        {
+            first = filter->next[i];
+            *length = filter->lengths[i];
+        }
+    }
+    return first;
+}
+
+/**
+ * @brief Tells whether a literal of the prefilter holds a byte
+ */
+static int prefilter_holds(const prefilter *filter, char byte)
+{
+    for (size_t i = 0; i < filter->count; i++)
+        if (memchr(filter->literals[i], byte, filter->lengths[i]))
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief Counts the non-overlapping prefilter hits in a block
+ */
+static uint64_t count_hits(const char *data, size_t length, prefilter *filter)
+{
+    uint64_t hits = 0;
+    const char *end = data + length;
+    const char *hit;
+    size_t hit_length;
+
+    rewind_prefilter(filter);
+    while ((hit = prefilter_next(filter, data, end, &hit_length)) != NULL)
+    {
+        hits++;
+        data = hit + hit_length;
+    }
+    return hits;
+}
+
+/**
+ * @brief Samples the input and picks the strategy that suits its match density
+ *
+ * Up to PLAN_SAMPLES blocks spread evenly over the input are searched for the prefilter
+ * literal. No hit means passthrough; hits far apart on short lines mean span-gather; anything
+ * denser is rewritten whole.
+ *
+ * @param fd Descriptor of the input
+ * @param size Size of the input
+ * @param options Replacement options
+ * @param stats Receives the plan and what the sample saw
+ * @return int PLAN_PASSTHROUGH, PLAN_SPANS or PLAN_REWRITE
+ */
+static int choose_plan(int fd, off_t size, const replace_options *options, replace_stats *stats)
+{
+    prefilter filter;
+    if (start_prefilter(&filter, options) != 0)
+        return PLAN_REWRITE;
+    if (filter.count == 0)
+        return PLAN_PASSTHROUGH; // An empty search text never matches
+
+    char *sample = malloc(PLAN_SAMPLE_SIZE);
+    if (!sample)
+        return PLAN_REWRITE;
+
+    uint64_t sampled = 0;
+    uint64_t newlines = 0;
+    uint64_t hits = 0;
+    off_t stride = size / PLAN_SAMPLES > PLAN_SAMPLE_SIZE ? size / PLAN_SAMPLES : PLAN_SAMPLE_SIZE;
+
+    for (off_t offset = 0; offset < size; offset += stride)
+    {
+        ssize_t got = pread(fd, sample, PLAN_SAMPLE_SIZE, offset);
+        if (got <= 0)
+            break;
+        sampled += got;
+        newlines += count_newlines(sample, got);
+        hits += count_hits(sample, got, &filter);
+    }
+    free(sample);
+
+    stats->sampled_bytes = sampled;
+    stats->sampled_hits = hits;
+
+    if (hits == 0)
+        return PLAN_PASSTHROUGH;
+
+    // Span-gather runs each line holding a hit through the engine and copies the rest
+    uint64_t line_length = sampled / (newlines + 1);
+    uint64_t gap = sampled / hits;
+    if (gap < PLAN_MIN_GAP || hits * line_length * PLAN_MAX_SCANNED > sampled)
+        return PLAN_REWRITE;
+    return PLAN_SPANS;
+}
+
+/**
+ * @brief Copies the input to the output, running only the lines holding a prefilter hit
+ * through the engine; the spans between them are copied inside the kernel
+ *
+ * Without any hit the whole input goes out as a single copy.
+ */
+static void gather_spans(int fd, FILE *optr, off_t size, const replace_options *options)
+{
+    prefilter filter;
+    start_prefilter(&filter, options);
+    size_t capacity = COPY_CHUNK;
+    char *buffer = malloc(capacity);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    text_buffer replaced = {NULL, 0, 0};
+    off_t position = 0;
+    off_t copied = 0; // Input before this offset is already in the output
+    uint64_t lines = 0;
+    uint64_t replacements = 0;
+    ssize_t length;
+
+    // Once --max-count is reached the final copy takes the rest of the input
+    while (filter.count > 0 && position < size && replacements_left(options, replacements) > 0 &&
+           (length = read_lines(fd, position, size, &buffer, &capacity)) > 0)
+    {
+        const char *end = buffer + length;
+        const char *cursor = buffer;
+        const char *hit;
+        size_t hit_length;
+        uint64_t before = replacements;
+
+        rewind_prefilter(&filter);
+
+        while (replacements_left(options, replacements) > 0 &&
+               (hit = prefilter_next(&filter, cursor, end, &hit_length)) != NULL)
+        {
+            const char *newline = memrchr(buffer, '\n', hit - buffer);
+            const char *line = newline ? newline + 1 : buffer;
+            const char *line_end = memchr(hit, '\n', end - hit);
+            line_end = line_end ? line_end + 1 : end;
+
+            replaced.length = 0;
+            int count = replace_line(line, line_end - line, options, replacements_left(options, replacements),
+                                     &replaced);
+            if (count)
+            {
+                off_t line_offset = position + (line - buffer);
+                fflush(optr);
+                if (copy_range(fd, copied, line_offset - copied, fileno(optr)) != 0)
+                    exit(OUTPUT_FILE_UNWRITABLE);
+                if (options->stats)
+                    options->stats->bytes_copied += line_offset - copied;
+                fwrite(replaced.data, 1, replaced.length, optr);
+                copied = line_offset + (line_end - line);
+                replacements += count;
+            }
+            lines++;
+            cursor = line_end;
+        }
+
+        position += length;
+        update_progress(options->progress, length, 0, replacements - before);
+    }
+
+    fflush(optr);
+    if (copy_range(fd, copied, size - copied, fileno(optr)) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    if (filter.count == 0)
+        update_progress(options->progress, size, 0, 0);
+
+    if (options->stats)
+    {
+        options->stats->bytes_copied += size - copied;
+        options->stats->lines += lines;
+        options->stats->replacements += replacements;
+    }
+    free(buffer);
+    free(replaced.data);
+}
+
+/**
+ * @brief Runs the engine over the whole input, a buffer of whole lines at a time
+ */
+static void rewrite_lines(int fd, FILE *optr, off_t size, const replace_options *options)
+{
+    size_t capacity = COPY_CHUNK;
+    char *buffer = malloc(capacity);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    text_buffer output = {NULL, 0, 0};
+    off_t position = 0;
+    long line = 1;
+    uint64_t replacements = 0;
+    ssize_t length;
+
+    while (position < size && (length = read_lines(fd, position, size, &buffer, &capacity)) > 0)
+    {
+        output.length = 0;
+        uint64_t count = replace_span(buffer, length, options, line, replacements_left(options, replacements),
+                                      &output);
+        fwrite(output.data, 1, output.length, optr);
+        replacements += count;
+
+        line += count_newlines(buffer, length);
+        position += length;
+        update_progress(options->progress, length, line, count);
+
+        if (replacements_left(options, replacements) == 0)
+        {
+            // --max-count reached, copy the rest inside the kernel
+            fflush(optr);
+            if (copy_range(fd, position, size - position, fileno(optr)) != 0)
+                exit(OUTPUT_FILE_UNWRITABLE);
+            update_progress(options->progress, size - position, 0, 0);
+            if (options->stats)
+                options->stats->bytes_copied += size - position;
+            break;
+        }
+    }
+
+    free(buffer);
+    free(output.data);
+}
+
+/**
+ * @brief Runs the replacement over one field of every record, a buffer of whole records at a time
+ *
+ * Only the records holding a prefilter hit are split into fields; the bytes between them are
+ * written as they were read.
+ */
+static void replace_records(int fd, FILE *optr, off_t size, const replace_options *options)
+{
+    prefilter filter;
+    // A quote is doubled in a quoted field, so a literal holding one may not appear in the raw bytes
+    // of a field whose value matches
+    int filtered = start_prefilter(&filter, options) == 0 && !prefilter_holds(&filter, QUOTE);
+    size_t capacity = COPY_CHUNK;
+    char *buffer = malloc(capacity);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    text_buffer replaced = {NULL, 0, 0};
+    off_t position = 0;
+    uint64_t records = 0;
+    uint64_t replacements = 0;
+    ssize_t length;
+
+    while (position < size && replacements_left(options, replacements) > 0 &&
+           (length = read_lines(fd, position, size, &buffer, &capacity)) > 0)
+    {
+        // A quoted field may hold newlines, so the buffer is cut after the last complete record
+        size_t usable = position + length == size ? (size_t)length
+                                                   : complete_records(buffer, length, options->delimiter);
+        if (usable == 0)
+        {
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            buffer = grown;
+            capacity *= 2;
+            continue;
+        }
+
+        const char *end = buffer + usable;
+        const char *cursor = buffer;
+        size_t hit_length;
+        uint64_t before = replacements;
+
+        rewind_prefilter(&filter);
+
+        while (cursor < end)
+        {
+            const char *hit = filtered ? prefilter_next(&filter, cursor, end, &hit_length) : cursor;
+            if (!hit || replacements_left(options, replacements) == 0)
+            {
+                fwrite(cursor, 1, end - cursor, optr);
+                break;
+            }
+
+            const char *record = cursor;
+            size_t record_length = next_record(record, end - record, options->delimiter);
+            while (record + record_length <= hit)
+            {
+                record += record_length;
+                record_length = next_record(record, end - record, options->delimiter);
+            }
+
+            fwrite(cursor, 1, record - cursor, optr);
+            replaced.length = 0;
+            replacements += field_replace(record, record_length, options, replacements_left(options, replacements),
+                                          &replaced);
+            fwrite(replaced.data, 1, replaced.length, optr);
+            records++;
+            cursor = record + record_length;
+        }
+
+        position += usable;
+        update_progress(options->progress, usable, 0, replacements - before);
+    }
+
+    // Whatever --max-count left unread is copied inside the kernel
+    fflush(optr);
+    if (position < size && copy_range(fd, position, size - position, fileno(optr)) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    update_progress(options->progress, size - position, 0, 0);
+
+    if (options->stats)
+    {
+        options->stats->bytes_copied += size - position;
+        options->stats->lines += records;
+        options->stats->replacements += replacements;
+    }
+    free(buffer);
+    free(replaced.data);
+}
+
+/**
+ * @brief Runs the engine over the lines inside the -l /marker/ ranges only, a buffer of whole lines
+ * at a time
+ *
+ * Outside a range only the start marker is searched for, and inside one only the end marker, so
+ * each byte is scanned once. Only the lines of a range go through the engine; the rest of the
+ * input is copied inside the kernel.
+ */
+static void replace_ranges(int fd, FILE *optr, off_t size, const replace_options *options)
+{
+    range_cursor ranges;
+    start_ranges(&ranges, options->range);
+    size_t capacity = COPY_CHUNK;
+    char *buffer = malloc(capacity);
+    if (!buffer)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    text_buffer output = {NULL, 0, 0};
+    off_t position = 0;
+    off_t copied = 0; // Input before this offset is already in the output
+    long line = 1;
+    uint64_t replacements = 0;
+    ssize_t length;
+
+    // Once no range can open, or --max-count is reached, the final copy takes the rest of the input
+    while (position < size && !ranges.done && replacements_left(options, replacements) > 0 &&
+           (length = read_lines(fd, position, size, &buffer, &capacity)) > 0)
+    {
+        const char *end = buffer + length;
+        const char *cursor = buffer;
+        uint64_t before = replacements;
+
+        while (cursor < end && replacements_left(options, replacements) > 0)
+        {
+            if (!ranges.active)
+            {
+                cursor = find_range_start(&ranges, cursor, end, &line);
+                if (!cursor)
+                    break;
+
+                off_t offset = position + (cursor - buffer);
+                fflush(optr);
+                if (copy_range(fd, copied, offset - copied, fileno(optr)) != 0)
+                    exit(OUTPUT_FILE_UNWRITABLE);
+                if (options->stats)
+                    options->stats->bytes_copied += offset - copied;
+                copied = offset;
+            }
+
+            long first_line = line;
+            const char *stop = find_range_end(&ranges, cursor, end, &line);
+            if (!stop)
+                stop = end;
+
+            output.length = 0;
+            replacements += replace_span(cursor, stop - cursor, options, first_line,
+                                         replacements_left(options, replacements), &output);
+            fwrite(output.data, 1, output.length, optr);
+            copied = position + (stop - buffer);
+            cursor = stop;
+        }
+
+        position += length;
+        update_progress(options->progress, length, 0, replacements - before);
+    }
+
+    fflush(optr);
+    if (copy_range(fd, copied, size - copied, fileno(optr)) != 0)
+        exit(OUTPUT_FILE_UNWRITABLE);
+    update_progress(options->progress, size - position, 0, 0);
+    if (options->stats)
+        options->stats->bytes_copied += size - copied;
+
+    free(buffer);
+    free(output.data);
+}
+
+/**
+ * @brief Plans and runs the replacement of a whole input
+ *
+ * @param fptr Input file, at its start
+ * @param optr Output file
+ * @param options Replacement options
+ * @return int 0 if the input was processed, -1 if it is left to process_lines(): a diff, a numeric
+ * line range, a field run within /marker/ ranges, or an input that is not a regular file
+ */
+int run_plan(FILE *fptr, FILE *optr, const replace_options *options)
+{
+    int fd = fileno(fptr);
+    struct stat st;
+    if (options->diff != DIFF_NONE || options->minimum > 1 || options->maximum < LONG_MAX ||
+        fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    replace_stats unused;
+    replace_stats *stats = options->stats ? options->stats : &unused;
+    if (options->range)
+    {
+        // A quoted field may span lines, so field runs match their records against the markers one by one
+        if (options->field)
+            return -1;
+        stats->plan = PLAN_RANGES;
+        replace_ranges(fd, optr, st.st_size, options);
+        return 0;
+    }
+
+    if (options->field)
+    {
+        stats->plan = PLAN_FIELDS;
+        replace_records(fd, optr, st.st_size, options);
+        return 0;
+    }
+
+    stats->plan = choose_plan(fd, st.st_size, options, stats);
+
+    if (stats->plan == PLAN_PASSTHROUGH && stats->sampled_bytes == (uint64_t)st.st_size)
+    {
+        // The sample was the whole input, so nothing needs scanning again
+        if (copy_range(fd, 0, st.st_size, fileno(optr)) != 0)
+            exit(OUTPUT_FILE_UNWRITABLE);
+        update_progress(options->progress, st.st_size, 0, 0);
+        if (options->stats)
+            options->stats->bytes_copied += st.st_size;
+    }
+    else if (stats->plan == PLAN_REWRITE)
+    {
+        rewrite_lines(fd, optr, st.st_size, options);
+    }
+    else
+    {
+        gather_spans(fd, optr, st.st_size, options);
+    }
+    return 0;
+}
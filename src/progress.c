@@ -0,0 +1,163 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <signal.h>
+
+// Set by SIGUSR1 when no reporter thread runs, and cleared by the next update that reports
+static atomic_int report_requested = 0;
+
+/**
+ * @brief Seconds elapsed between two instants
+ */
+static double seconds_between(const struct timespec *from, const struct timespec *to)
+{
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Prints one progress line, dd style, and remembers it as the previous report
+ *
+ * @param progress Counters to report
+ */
+static void report_progress(progress_counter *progress)
+{
+    uint64_t *last_bytes = &progress->last_bytes;
+    struct timespec *last_time = &progress->last_time;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t bytes = atomic_load_explicit(&progress->bytes, memory_order_relaxed);
+    uint64_t line = atomic_load_explicit(&progress->line, memory_order_relaxed);
+    uint64_t matches = atomic_load_explicit(&progress->matches, memory_order_relaxed);
+
+    double interval = seconds_between(last_time, &now);
+    double rate = interval > 0 ? (double)(bytes - *last_bytes) / interval : 0;
+
+    // The ETA uses the average rate, which is far steadier than the one since the last report
+    double elapsed = seconds_between(&progress->started, &now);
+    double average = elapsed > 0 ? (double)bytes / elapsed : 0;
+
+    fprintf(stderr, "%llu", (unsigned long long)bytes);
+    if (progress->total)
+        fprintf(stderr, " of %llu", (unsigned long long)progress->total);
+    fprintf(stderr, " bytes, ");
+    if (line)
+        fprintf(stderr, "line %llu, ", (unsigned long long)line);
+    fprintf(stderr, "%llu matches, %.1f MB/s", (unsigned long long)matches, rate / 1e6);
+    if (progress->total > bytes && average > 0)
+        fprintf(stderr, ", eta %.0f s", (double)(progress->total - bytes) / average);
+    fputc('\n', stderr);
+
+    *last_bytes = bytes;
+    *last_time = now;
+}
+
+/**
+ * @brief Body of the reporter thread: waits for SIGUSR1 or the next interval, then reports
+ */
+static void *progress_reporter(void *argument)
+{
+    progress_counter *progress = argument;
+    sigset_t wanted;
+    sigemptyset(&wanted);
+    sigaddset(&wanted, SIGUSR1);
+    struct timespec timeout = {progress->interval, 0};
+
+    for (;;)
+    {
+        int signal_number = progress->interval ? sigtimedwait(&wanted, NULL, &timeout) : sigwaitinfo(&wanted, NULL);
+        if (atomic_load(&progress->done))
+            break;
+        if (signal_number < 0 && errno != EAGAIN)
+            continue; // Interrupted by another signal
+        report_progress(progress);
+    }
+    return NULL;
+}
+
+/**
+ * @brief SIGUSR1 handler of runs without a reporter thread: asks the next update to report
+ */
+static void request_report(int signal_number)
+{
+    (void)signal_number;
+    atomic_store(&report_requested, 1);
+}
+
+/**
+ * @brief Starts reporting progress on SIGUSR1 and, optionally, at a fixed interval
+ *
+ * A reporter thread is only started with an interval. It must then be started before any other
+ * thread, since SIGUSR1 is blocked in the calling thread so that only the reporter receives it.
+ * Without an interval, SIGUSR1 only sets a flag, and the next update_progress() prints the report.
+ *
+ * @param progress Counters to reset and report
+ * @param total Size of the input in bytes, 0 if unknown
+ * @param interval Seconds between reports, 0 to report only on SIGUSR1
+ * @return int 0 on success, -1 if reporting could not be started
+ */
+int start_progress(progress_counter *progress, uint64_t total, unsigned interval)
+{
+    atomic_init(&progress->bytes, 0);
+    atomic_init(&progress->line, 0);
+    atomic_init(&progress->matches, 0);
+    atomic_init(&progress->done, 0);
+    progress->total = total;
+    progress->interval = interval;
+    clock_gettime(CLOCK_MONOTONIC, &progress->started);
+    progress->last_bytes = 0;
+    progress->last_time = progress->started;
+
+    if (!interval)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_report;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        return sigaction(SIGUSR1, &action, NULL) == 0 ? 0 : -1;
+    }
+
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &blocked, NULL) != 0)
+        return -1;
+
+    return pthread_create(&progress->reporter, NULL, progress_reporter, progress) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Publishes the work done since the last update; callers batch it per chunk, not per line
+ *
+ * @param progress Counters, NULL when progress is not reported
+ * @param bytes Input bytes processed since the last update
+ * @param line Line now being processed, 0 to keep the last one published
+ * @param matches Replacements made since the last update
+ */
+void update_progress(progress_counter *progress, uint64_t bytes, uint64_t line, uint64_t matches)
+{
+    if (!progress)
+        return;
+    atomic_fetch_add_explicit(&progress->bytes, bytes, memory_order_relaxed);
+    if (line)
+        atomic_store_explicit(&progress->line, line, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress->matches, matches, memory_order_relaxed);
+
+    if (atomic_load_explicit(&report_requested, memory_order_relaxed) && atomic_exchange(&report_requested, 0))
+        report_progress(progress);
+}
+
+/**
+ * @brief Stops the reporter thread, if start_progress() started one
+ *
+ * @param progress Counters whose reporting was started by start_progress()
+ */
+void stop_progress(progress_counter *progress)
+{
+    if (!progress->interval)
+        return;
+    atomic_store(&progress->done, 1);
+    pthread_kill(progress->reporter, SIGUSR1);
+    pthread_join(progress->reporter, NULL);
+}
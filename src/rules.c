@@ -0,0 +1,324 @@
+#include "hw5.h"
+
+#include <sys/mman.h>
+
+/**
+ * @brief Appends a node to a trie, growing its array when full
+ *
+ * @return int32_t Index of the new node
+ */
+static int32_t new_node(trie_node **nodes, size_t *count, size_t *capacity, unsigned char byte)
+{
+    if (*count == *capacity)
+    {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        trie_node *resized = realloc(*nodes, grown * sizeof(trie_node));
+        if (!resized)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *nodes = resized;
+        *capacity = grown;
+    }
+
+    trie_node *node = &(*nodes)[*count];
+    memset(node, 0, sizeof(*node)); // Compiled rule sets are saved byte for byte, padding included
+    node->byte = byte;
+    node->child = -1;
+    node->sibling = -1;
+    node->rule = -1;
+    return (int32_t)(*count)++;
+}
+
+/**
+ * @brief Inserts an affix into a trie, one byte per level
+ *
+ * @param nodes Nodes of the trie
+ * @param count Number of nodes
+ * @param capacity Capacity of the node array
+ * @param affix Affix to insert
+ * @param length Length of the affix
+ * @param step 1 to insert the affix as is, -1 to insert it last byte first
+ * @param rule Rule to record at the last node, unless an earlier rule has the same affix
+ */
+static void insert_affix(trie_node **nodes, size_t *count, size_t *capacity, const char *affix, size_t length,
+                         int step, int32_t rule)
+{
+    int32_t current = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char byte = (unsigned char)affix[step > 0 ? i : length - 1 - i];
+        int32_t child = (*nodes)[current].child;
+        while (child >= 0 && (*nodes)[child].byte != byte)
+            child = (*nodes)[child].sibling;
+
+        if (child < 0)
+        {
+            child = new_node(nodes, count, capacity, byte);
+            (*nodes)[child].sibling = (*nodes)[current].child;
+            (*nodes)[current].child = child;
+        }
+        current = child;
+    }
+
+    if ((*nodes)[current].rule < 0)
+        (*nodes)[current].rule = rule;
+}
+
+/**
+ * @brief Tells whether a rule index names a rule whose replacement lies in the strings
+ *
+ * The arrays of a compiled file are used as they were mapped, so an index read from them is
+ * checked before it is followed; a corrupted file then misses words instead of reading out of
+ * bounds.
+ */
+static int valid_rule(const rule_set *rules, int32_t rule)
+{
+    return rule >= 0 && (size_t)rule < rules->count &&
+           rules->rules[rule].replacement <= rules->strings.length &&
+           rules->rules[rule].replacement_length <= rules->strings.length - rules->rules[rule].replacement;
+}
+
+/**
+ * @brief Walks a trie along a word and keeps the best rule met on the way
+ *
+ * A node has at most one child per byte, so a sibling chain longer than 256 only occurs in a
+ * corrupted compiled file and ends the walk, as does a node index past the trie.
+ *
+ * @param nodes Nodes of the trie
+ * @param count Number of nodes
+ * @param word Word to walk
+ * @param length Length of the word
+ * @param step 1 to walk from the first byte, -1 to walk from the last
+ * @param best Best rule so far, -1 if none, updated
+ * @param rules Rule set, for the priority of each rule
+ */
+static void walk_trie(const trie_node *nodes, size_t count, const char *word, size_t length, int step, int32_t *best,
+                      const rule_set *rules)
+{
+    int32_t current = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char byte = (unsigned char)word[step > 0 ? i : length - 1 - i];
+        int32_t child = nodes[current].child;
+        for (int siblings = 0; child >= 0 && (size_t)child < count && nodes[child].byte != byte; siblings++)
+            child = siblings < 256 ? nodes[child].sibling : -1;
+        if (child < 0 || (size_t)child >= count)
+            return;
+
+        current = child;
+        int32_t rule = nodes[current].rule;
+        if (valid_rule(rules, rule) &&
+            (*best < 0 || rules->rules[rule].affix_length > rules->rules[*best].affix_length ||
+             (rules->rules[rule].affix_length == rules->rules[*best].affix_length && rule < *best)))
+        {
+            *best = rule;
+        }
+    }
+}
+
+/**
+ * @brief Sets up an empty rule set
+ *
+ * @param rules Rule set to initialize
+ */
+void init_rules(rule_set *rules)
+{
+    memset(rules, 0, sizeof(*rules));
+    rules->digest = FNV_OFFSET_BASIS;
+    new_node(&rules->prefixes, &rules->prefix_count, &rules->prefix_capacity, 0);
+    new_node(&rules->suffixes, &rules->suffix_count, &rules->suffix_capacity, 0);
+}
+
+/**
+ * @brief Adds a wildcard rule; rules added first win ties
+ *
+ * @param rules Rule set
+ * @param pattern Pattern with a single '*' at its start or its end, as for -w
+ * @param replacement Text replacing the words the pattern matches
+ * @return int 0 on success, WILDCARD_INVALID if the pattern is not a valid wildcard
+ */
+int add_rule(rule_set *rules, const char *pattern, const char *replacement)
+{
+    replace_options check = {0};
+    check.search = (char *)pattern;
+    check.replace = (char *)replacement;
+    check.wildcard = 1;
+    if (compile_pattern(&check) != 0)
+        return WILDCARD_INVALID;
+
+    if (rules->count == rules->capacity)
+    {
+        size_t grown = rules->capacity ? rules->capacity * 2 : 16;
+        wildcard_rule *resized = realloc(rules->rules, grown * sizeof(wildcard_rule));
+        if (!resized)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        rules->rules = resized;
+        rules->capacity = grown;
+    }
+
+    wildcard_rule *rule = &rules->rules[rules->count];
+    rule->replacement = rules->strings.length;
+    buffer_append(&rules->strings, replacement, check.replace_length);
+    rule->replacement_length = check.replace_length;
+    rule->affix_length = check.search_length - 1;
+    rules->digest = fnv1a(rules->digest, pattern, check.search_length + 1);
+    rules->digest = fnv1a(rules->digest, replacement, check.replace_length + 1);
+
+    if (pattern[0] == '*')
+        insert_affix(&rules->suffixes, &rules->suffix_count, &rules->suffix_capacity, pattern + 1,
+                     rule->affix_length, -1, (int32_t)rules->count);
+    else
+        insert_affix(&rules->prefixes, &rules->prefix_count, &rules->prefix_capacity, pattern,
+                     rule->affix_length, 1, (int32_t)rules->count);
+
+    rules->count++;
+    return 0;
+}
+
+/**
+ * @brief Adds the rules of a file, one "pattern<TAB>replacement" per line
+ *
+ * Empty lines and lines starting with '#' are skipped.
+ *
+ * @param rules Rule set
+ * @param path Path of the rules file
+ * @return int 0 on success, INPUT_FILE_MISSING if the file cannot be read, WILDCARD_INVALID for a bad rule
+ */
+int load_rules(rule_set *rules, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return INPUT_FILE_MISSING;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = 0;
+
+    while (status == 0 && (length = getline(&line, &capacity, file)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length > 0 && line[length - 1] == '\r')
+            line[--length] = '\0';
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        char *tab = strchr(line, '\t');
+        if (!tab)
+        {
+            status = WILDCARD_INVALID;
+            break;
+        }
+        *tab = '\0';
+        status = add_rule(rules, line, tab + 1);
+    }
+
+    free(line);
+    fclose(file);
+    return status;
+}
+
+/**
+ * @brief Sets up the rule set of a --rules run from a compiled file, or from a text file whose rules
+ * come after the -s/-r pair when one is given
+ *
+ * @param rules Rule set to fill in; released with free_rules() whatever the result
+ * @param path Path of the rule file
+ * @param search -s text, NULL when not given
+ * @param replace -r text, NULL when not given
+ * @return int 0 on success, MISSING_ARGUMENT for a compiled file given with -s and -r, otherwise the
+ * status of load_compiled_rules(), add_rule() or load_rules()
+ */
+int open_rules(rule_set *rules, const char *path, const char *search, const char *replace)
+{
+    init_rules(rules);
+    int status = load_compiled_rules(rules, path);
+    if (status == 0 && search)
+        return MISSING_ARGUMENT;
+    if (status < 0)
+    {
+        status = search ? add_rule(rules, search, replace) : 0;
+        if (status == 0)
+            status = load_rules(rules, path);
+    }
+    return status;
+}
+
+/**
+ * @brief Releases a rule set
+ *
+ * @param rules Rule set
+ */
+void free_rules(rule_set *rules)
+{
+    if (rules->mapping)
+    {
+        munmap(rules->mapping, rules->mapping_length);
+        return;
+    }
+    free(rules->strings.data);
+    free(rules->rules);
+    free(rules->prefixes);
+    free(rules->suffixes);
+}
+
+/**
+ * @brief Finds the rule applying to a word, with one walk of each trie
+ *
+ * @param rules Rule set
+ * @param word Word, which need not be NUL-terminated
+ * @param length Length of the word
+ * @return int Index of the winning rule, -1 if no rule matches
+ */
+int match_rules(const rule_set *rules, const char *word, size_t length)
+{
+    int32_t best = -1;
+    walk_trie(rules->prefixes, rules->prefix_count, word, length, 1, &best, rules);
+    walk_trie(rules->suffixes, rules->suffix_count, word, length, -1, &best, rules);
+    return best;
+}
+
+/**
+ * @brief Replaces every word of a line matched by a rule set
+ *
+ * @param line Line to search
+ * @param length Length of the line
+ * @param rules Rule set
+ * @param limit Most words to replace, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of words replaced
+ */
+int rules_replace(const char *line, size_t length, const rule_set *rules, uint64_t limit, text_buffer *output)
+{
+    const char *end = line + length;
+    const char *cursor = line;
+    const char *copied = line;
+    int replaced = 0;
+
+    while ((uint64_t)replaced < limit && cursor < end)
+    {
+        const char *word = skip_non_word_characters(cursor, end);
+        cursor = skip_word(word, end);
+        if (cursor == word)
+            break;
+
+        int rule = match_rules(rules, word, cursor - word);
+        if (rule >= 0)
+        {
+            buffer_append(output, copied, word - copied);
+            buffer_append(output, rules->strings.data + rules->rules[rule].replacement,
+                          rules->rules[rule].replacement_length);
+            copied = cursor;
+            replaced++;
+        }
+    }
+
+    buffer_append(output, copied, end - copied);
+    return replaced;
+}
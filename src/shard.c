@@ -0,0 +1,489 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define WALK_DESCRIPTORS 64
+
+/**
+ * @brief A file to process and the size it weighs in the partition
+ */
+typedef struct
+{
+    char *path;     // Path to read the file from
+    char *relative; // Path of the file under the output directory
+    uint64_t size;
+} shard_file;
+
+/**
+ * @brief Growable list of files
+ */
+typedef struct
+{
+    shard_file *items;
+    size_t count;
+    size_t capacity;
+} file_list;
+
+/**
+ * @brief Totals of a shard, as written to its stats fragment
+ */
+typedef struct
+{
+    uint64_t files;        // Files assigned to the shard
+    uint64_t bytes;        // Total size of those files
+    uint64_t binaries;     // Files classified as binary
+    uint64_t lines;        // Lines run through the replacement engine
+    uint64_t replacements; // Replacements made
+    uint64_t bytes_copied; // Bytes copied to the output without being scanned
+    uint64_t cache_hits;   // Files whose result came from the --cache directory
+    double seconds;        // Wall time of the shard
+} shard_totals;
+
+static file_list *walk_list;    // Receives the files found by nftw(), which takes no user data
+static size_t walk_root_length; // Length of the walked directory, stripped from the paths found
+static struct stat walk_skip;   // Output directory, left out of the walk
+
+/**
+ * @brief Appends a file to a list
+ */
+static void push_file(file_list *list, const char *path, const char *relative, uint64_t size)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        shard_file *grown = realloc(list->items, capacity * sizeof(shard_file));
+        if (!grown)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        list->items = grown;
+        list->capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    char *relative_copy = strdup(relative);
+    if (!copy || !relative_copy)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    list->items[list->count].path = copy;
+    list->items[list->count].relative = relative_copy;
+    list->items[list->count].size = size;
+    list->count++;
+}
+
+/**
+ * @brief nftw() callback collecting regular files, leaving out the output directory and the
+ * sidecars this tool writes
+ */
+static int collect_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)ftw;
+    size_t length = strlen(path);
+    size_t index_length = strlen(INDEX_EXTENSION);
+    size_t journal_length = strlen(JOURNAL_EXTENSION);
+
+    if (type == FTW_D && st->st_dev == walk_skip.st_dev && st->st_ino == walk_skip.st_ino)
+        return FTW_SKIP_SUBTREE;
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return FTW_CONTINUE;
+    if ((length >= index_length && strcmp(path + length - index_length, INDEX_EXTENSION) == 0) ||
+        (length >= journal_length && strcmp(path + length - journal_length, JOURNAL_EXTENSION) == 0))
+        return FTW_CONTINUE;
+
+    const char *relative = path + walk_root_length;
+    while (*relative == '/')
+        relative++;
+    push_file(walk_list, path, relative, st->st_size);
+    return FTW_CONTINUE;
+}
+
+/**
+ * @brief Maps a manifest entry to a path under the output directory
+ *
+ * @return const char* The path without its leading "/" and "./", NULL if it climbs out with ".."
+ */
+static const char *manifest_relative(const char *path)
+{
+    for (;;)
+    {
+        if (path[0] == '/')
+            path++;
+        else if (path[0] == '.' && path[1] == '/')
+            path += 2;
+        else
+            break;
+    }
+
+    for (const char *part = path; part; part = strchr(part, '/') ? strchr(part, '/') + 1 : NULL)
+    {
+        if (part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == '\0'))
+            return NULL;
+    }
+    return path;
+}
+
+/**
+ * @brief Reads a manifest of paths, one per line
+ *
+ * @return int 0 on success, INPUT_FILE_MISSING if the manifest or a listed file cannot be read,
+ * OUTPUT_FILE_UNWRITABLE if a path would land outside the output directory
+ */
+static int read_manifest(const char *manifest, file_list *list)
+{
+    FILE *file = fopen(manifest, "r");
+    if (!file)
+        return INPUT_FILE_MISSING;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = 0;
+
+    while ((length = getline(&line, &capacity, file)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+
+        struct stat st;
+        const char *relative = manifest_relative(line);
+        if (stat(line, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            status = INPUT_FILE_MISSING;
+            break;
+        }
+        if (!relative || *relative == '\0')
+        {
+            status = OUTPUT_FILE_UNWRITABLE;
+            break;
+        }
+        push_file(list, line, relative, st.st_size);
+    }
+
+    free(line);
+    fclose(file);
+    return status;
+}
+
+/**
+ * @brief Orders files by decreasing size, then by path, so every shard sees the same order
+ */
+static int compare_files(const void *left, const void *right)
+{
+    const shard_file *a = left;
+    const shard_file *b = right;
+    if (a->size != b->size)
+        return a->size > b->size ? -1 : 1;
+    return strcmp(a->path, b->path);
+}
+
+/**
+ * @brief Creates the directories leading to a path, like mkdir -p on its parent
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int make_parents(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        int failed = mkdir(path, 0777) != 0 && errno != EEXIST;
+        *slash = '/';
+        if (failed)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the replaced copy of one file under the output directory
+ *
+ * @param file File to process
+ * @param outputDir Output directory
+ * @param options Replacement options, with stats set
+ * @param binaryMode What to do with binary files, as for --binary
+ * @param totals Totals of the shard, updated
+ * @return int 0 on success, -1 on failure
+ */
+static int replace_file(const shard_file *file, const char *outputDir, const replace_options *options,
+                        int binaryMode, shard_totals *totals)
+{
+    size_t length = strlen(outputDir) + strlen(file->relative) + 2;
+    char *target = malloc(length);
+    if (!target)
+        return -1;
+    snprintf(target, length, "%s/%s", outputDir, file->relative);
+
+    int result = -1;
+    FILE *fptr = fopen(file->path, "r");
+    FILE *optr = NULL;
+    if (!fptr)
+        goto done;
+
+    int binary = binaryMode != BINARY_TEXT && sniff_file(fileno(fptr)) == FILE_BINARY;
+    if (binary)
+        totals->binaries++;
+    if (binary && binaryMode == BINARY_SKIP)
+    {
+        result = 0;
+        goto done;
+    }
+
+    // A cached result is reused when the output left by the last run still has its digest
+    cache_result cached;
+    int hit = options->cache && !binary ? cache_lookup(options, file->path, fileno(fptr), &cached) : -1;
+    if (hit == 1 && cache_output_matches(target, &cached))
+    {
+        options->stats->cache_hits++;
+        result = 0;
+        goto done;
+    }
+
+    if (make_parents(target) != 0 || (optr = fopen(target, "w")) == NULL)
+        goto done;
+
+    if (binary || (hit == 1 && cached.kind == CACHE_NO_MATCH))
+    {
+        if (copy_range(fileno(fptr), 0, file->size, fileno(optr)) != 0)
+            goto done;
+        options->stats->bytes_copied += file->size;
+        options->stats->cache_hits += !binary;
+    }
+    else
+    {
+        uint64_t before = options->stats->replacements;
+        if (run_plan(fptr, optr, options) != 0)
+            process_lines(fptr, optr, options, 1, -1);
+        if (fflush(optr) != 0)
+            goto done;
+        if (hit >= 0)
+            cache_finish(options, file->path, fileno(fptr), target, &cached, options->stats->replacements - before);
+    }
+    result = 0;
+
+done:
+    if (fptr)
+        fclose(fptr);
+    if (optr && fclose(optr) != 0)
+        result = -1;
+    free(target);
+    return result;
+}
+
+/**
+ * @brief Writes the stats fragment of a shard
+ */
+static void write_fragment(FILE *out, const char *input, long index, long count, const shard_totals *totals)
+{
+    fprintf(out, "input %s\n", input);
+    fprintf(out, "shard %ld/%ld\n", index, count);
+    fprintf(out, "files %llu\n", (unsigned long long)totals->files);
+    fprintf(out, "bytes %llu\n", (unsigned long long)totals->bytes);
+    fprintf(out, "binaries %llu\n", (unsigned long long)totals->binaries);
+    fprintf(out, "lines %llu\n", (unsigned long long)totals->lines);
+    fprintf(out, "replacements %llu\n", (unsigned long long)totals->replacements);
+    fprintf(out, "bytes_copied %llu\n", (unsigned long long)totals->bytes_copied);
+    fprintf(out, "cache_hits %llu\n", (unsigned long long)totals->cache_hits);
+    fprintf(out, "seconds %.6f\n", totals->seconds);
+}
+
+/**
+ * @brief Processes the share of a directory tree or manifest that belongs to one shard
+ *
+ * Files are sorted by decreasing size and each is given to the least loaded shard so far, so
+ * every shard gets about the same number of bytes. The input is only read, so every shard
+ * computes the same partition whether the shards run as local processes or on different machines.
+ *
+ * @param input Directory to walk, or manifest file listing one path per line
+ * @param outputDir Directory the processed files are written to, under their relative paths
+ * @param fragment Stream the stats fragment of the shard is written to
+ * @param options Replacement options
+ * @param index Number of this shard, from 1 to count
+ * @param count Number of shards
+ * @param binaryMode What to do with binary files, as for --binary
+ * @return int 0 on success, INPUT_FILE_MISSING if the file list cannot be built,
+ * OUTPUT_FILE_UNWRITABLE if a file could not be written
+ */
+int run_shard(const char *input, const char *outputDir, FILE *fragment, const replace_options *options,
+              long index, long count, int binaryMode)
+{
+    file_list list = {0};
+    struct stat st;
+    int status = 0;
+
+    if (stat(input, &st) != 0)
+        return INPUT_FILE_MISSING;
+    if ((mkdir(outputDir, 0777) != 0 && errno != EEXIST) || stat(outputDir, &walk_skip) != 0 ||
+        !S_ISDIR(walk_skip.st_mode))
+        return OUTPUT_FILE_UNWRITABLE;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        walk_list = &list;
+        walk_root_length = strlen(input);
+        if (nftw(input, collect_file, WALK_DESCRIPTORS, FTW_PHYS | FTW_ACTIONRETVAL) != 0)
+            status = INPUT_FILE_MISSING;
+        walk_list = NULL;
+    }
+    else
+    {
+        status = read_manifest(input, &list);
+    }
+
+    uint64_t *loads = calloc(count, sizeof(uint64_t));
+    if (!loads)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    replace_stats stats;
+    start_stats(&stats, input);
+    replace_options shard_options = *options;
+    shard_options.stats = &stats;
+    shard_totals totals = {0};
+
+    if (status == 0)
+        qsort(list.items, list.count, sizeof(shard_file), compare_files);
+
+    for (size_t i = 0; status == 0 && i < list.count; i++)
+    {
+        long lightest = 0;
+        for (long shard = 1; shard < count; shard++)
+        {
+            if (loads[shard] < loads[lightest])
+                lightest = shard;
+        }
+        loads[lightest] += list.items[i].size;
+
+        if (lightest != index - 1)
+            continue;
+
+        totals.files++;
+        totals.bytes += list.items[i].size;
+        if (replace_file(&list.items[i], outputDir, &shard_options, binaryMode, &totals) != 0)
+            status = OUTPUT_FILE_UNWRITABLE;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    totals.lines = stats.lines;
+    totals.replacements = stats.replacements;
+    totals.bytes_copied = stats.bytes_copied;
+    totals.cache_hits = stats.cache_hits;
+    totals.seconds = (double)(now.tv_sec - stats.started.tv_sec) + (double)(now.tv_nsec - stats.started.tv_nsec) / 1e9;
+    if (status == 0 || status == OUTPUT_FILE_UNWRITABLE)
+        write_fragment(fragment, input, index, count, &totals);
+
+    for (size_t i = 0; i < list.count; i++)
+    {
+        free(list.items[i].path);
+        free(list.items[i].relative);
+    }
+    free(list.items);
+    free(loads);
+    return status;
+}
+
+/**
+ * @brief Combines the stats fragments of several shards into one report
+ *
+ * Counters are summed; seconds is the slowest shard, which is the wall time of a parallel run.
+ *
+ * @param count Number of fragments
+ * @param paths Paths of the fragments
+ * @param out Stream the report is written to
+ * @return int 0 on success, INPUT_FILE_MISSING if a fragment cannot be read,
+ * MISSING_ARGUMENT if there is no fragment or they come from different shard counts,
+ * DUPLICATE_ARGUMENT if two fragments come from the same shard
+ */
+int merge_stats(int count, char *paths[], FILE *out)
+{
+    shard_totals totals = {0};
+    char *input = NULL;
+    long shards = 0;
+    unsigned char *seen = NULL; // Per shard, whether a fragment of it was merged
+    int status = count > 0 ? 0 : MISSING_ARGUMENT;
+
+    for (int i = 0; status == 0 && i < count; i++)
+    {
+        FILE *file = fopen(paths[i], "r");
+        if (!file)
+        {
+            status = INPUT_FILE_MISSING;
+            break;
+        }
+
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t length;
+        while ((length = getline(&line, &capacity, file)) != -1)
+        {
+            if (length > 0 && line[length - 1] == '\n')
+                line[--length] = '\0';
+
+            char *value = strchr(line, ' ');
+            if (!value)
+                continue;
+            *value++ = '\0';
+
+            long index, total;
+            if (strcmp(line, "input") == 0 && !input)
+                input = strdup(value);
+            else if (strcmp(line, "shard") == 0 && sscanf(value, "%ld/%ld", &index, &total) == 2)
+            {
+                if ((shards && shards != total) || index < 1 || index > total)
+                    status = MISSING_ARGUMENT;
+                else if (!seen && (seen = calloc(total + 1, 1)) == NULL)
+                    status = MISSING_ARGUMENT;
+                else if (seen[index]++)
+                    status = DUPLICATE_ARGUMENT;
+                shards = total;
+            }
+            else if (strcmp(line, "files") == 0)
+                totals.files += strtoull(value, NULL, 10);
+            else if (strcmp(line, "bytes") == 0)
+                totals.bytes += strtoull(value, NULL, 10);
+            else if (strcmp(line, "binaries") == 0)
+                totals.binaries += strtoull(value, NULL, 10);
+            else if (strcmp(line, "lines") == 0)
+                totals.lines += strtoull(value, NULL, 10);
+            else if (strcmp(line, "replacements") == 0)
+                totals.replacements += strtoull(value, NULL, 10);
+            else if (strcmp(line, "bytes_copied") == 0)
+                totals.bytes_copied += strtoull(value, NULL, 10);
+            else if (strcmp(line, "cache_hits") == 0)
+                totals.cache_hits += strtoull(value, NULL, 10);
+            else if (strcmp(line, "seconds") == 0 && strtod(value, NULL) > totals.seconds)
+                totals.seconds = strtod(value, NULL);
+        }
+
+        free(line);
+        fclose(file);
+    }
+
+    if (status == 0)
+    {
+        fprintf(out, "input %s\n", input ? input : "-");
+        fprintf(out, "shards %d/%ld\n", count, shards);
+        fprintf(out, "files %llu\n", (unsigned long long)totals.files);
+        fprintf(out, "bytes %llu\n", (unsigned long long)totals.bytes);
+        fprintf(out, "binaries %llu\n", (unsigned long long)totals.binaries);
+        fprintf(out, "lines %llu\n", (unsigned long long)totals.lines);
+        fprintf(out, "replacements %llu\n", (unsigned long long)totals.replacements);
+        fprintf(out, "bytes_copied %llu\n", (unsigned long long)totals.bytes_copied);
+        fprintf(out, "cache_hits %llu\n", (unsigned long long)totals.cache_hits);
+        fprintf(out, "seconds %.6f\n", totals.seconds);
+    }
+
+    free(input);
+    free(seen);
+    return status;
+}
@@ -0,0 +1,148 @@
+#include "hw5.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Checks whether a block holds a NUL byte, 16 bytes at a time where SSE2 is available
+ *
+ * @param data Bytes to check
+ * @param length Number of bytes
+ * @return int 1 if a NUL byte was found, 0 otherwise
+ */
+static int has_nul(const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)))
+            return 1;
+    }
+#endif
+    return memchr(data + i, '\0', length - i) != NULL;
+}
+
+/**
+ * @brief Length of the ASCII-only run at the start of a block, 16 bytes at a time where SSE2 is available
+ */
+static size_t ascii_prefix(const unsigned char *data, size_t length)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    // The sign bit of every byte is set exactly for non-ASCII bytes
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        if (_mm_movemask_epi8(block))
+            break;
+    }
+#endif
+    while (i < length && data[i] < 0x80)
+        i++;
+    return i;
+}
+
+/**
+ * @brief Counts the bytes of a block that are not part of a well-formed UTF-8 sequence
+ *
+ * A sequence cut off by the end of the block is not counted, since the block is only a sample.
+ *
+ * @param data Bytes to check
+ * @param length Number of bytes
+ * @return size_t Number of invalid bytes
+ */
+static size_t count_invalid_utf8(const unsigned char *data, size_t length)
+{
+    size_t invalid = 0;
+    size_t i = 0;
+
+    while (i < length)
+    {
+        i += ascii_prefix(data + i, length - i);
+        if (i >= length)
+            break;
+
+        unsigned char lead = data[i];
+        size_t needed;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+
+        if (lead >= 0xC2 && lead <= 0xDF)
+            needed = 1;
+        else if (lead >= 0xE0 && lead <= 0xEF)
+        {
+            needed = 2;
+            low = lead == 0xE0 ? 0xA0 : 0x80; // No overlong forms
+            high = lead == 0xED ? 0x9F : 0xBF; // No surrogates
+        }
+        else if (lead >= 0xF0 && lead <= 0xF4)
+        {
+            needed = 3;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        }
+        else
+        {
+            invalid++;
+            i++;
+            continue;
+        }
+
+        if (i + needed >= length)
+            break;
+
+        size_t good = 0;
+        if (data[i + 1] >= low && data[i + 1] <= high)
+        {
+            good = 1;
+            while (good < needed && data[i + 1 + good] >= 0x80 && data[i + 1 + good] <= 0xBF)
+                good++;
+        }
+
+        if (good == needed)
+        {
+            i += needed + 1;
+        }
+        else
+        {
+            invalid++;
+            i++;
+        }
+    }
+
+    return invalid;
+}
+
+/**
+ * @brief Classifies a block of bytes as text or binary
+ *
+ * @param data Bytes to classify
+ * @param length Number of bytes
+ * @return int FILE_BINARY if the block holds a NUL byte or too much invalid UTF-8, FILE_TEXT otherwise
+ */
+int classify_buffer(const unsigned char *data, size_t length)
+{
+    if (has_nul(data, length))
+        return FILE_BINARY;
+
+    return count_invalid_utf8(data, length) * 100 > length * SNIFF_INVALID_PERCENT ? FILE_BINARY : FILE_TEXT;
+}
+
+/**
+ * @brief Classifies a file from its first SNIFF_SIZE bytes, without moving its file offset
+ *
+ * @param fd Descriptor of the file
+ * @return int FILE_BINARY or FILE_TEXT, FILE_TEXT if the file cannot be read
+ */
+int sniff_file(int fd)
+{
+    unsigned char block[SNIFF_SIZE];
+    ssize_t got = pread(fd, block, sizeof(block), 0);
+    if (got <= 0)
+        return FILE_TEXT;
+    return classify_buffer(block, got);
+}
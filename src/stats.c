@@ -0,0 +1,40 @@
+#include "hw5.h"
+
+static const char *const plan_names[] = {"lines", "passthrough", "spans", "rewrite", "fields", "ranges"};
+
+/**
+ * @brief Starts collecting statistics for a run
+ *
+ * @param stats Statistics to reset
+ * @param input Name of the input file
+ */
+void start_stats(replace_stats *stats, const char *input)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->input = input;
+    clock_gettime(CLOCK_MONOTONIC, &stats->started);
+}
+
+/**
+ * @brief Prints the statistics of a run as "name value" lines
+ *
+ * @param out Stream to print to
+ * @param stats Statistics to print
+ */
+void print_stats(FILE *out, const replace_stats *stats)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - stats->started.tv_sec) + (double)(now.tv_nsec - stats->started.tv_nsec) / 1e9;
+
+    fprintf(out, "input %s\n", stats->input);
+    fprintf(out, "class %s\n", stats->binary == FILE_BINARY ? "binary" : "text");
+    fprintf(out, "lines %llu\n", (unsigned long long)stats->lines);
+    fprintf(out, "replacements %llu\n", (unsigned long long)stats->replacements);
+    fprintf(out, "bytes_copied %llu\n", (unsigned long long)stats->bytes_copied);
+    fprintf(out, "cache_hits %llu\n", (unsigned long long)stats->cache_hits);
+    fprintf(out, "plan %s\n", plan_names[stats->plan]);
+    fprintf(out, "sampled_bytes %llu\n", (unsigned long long)stats->sampled_bytes);
+    fprintf(out, "sampled_hits %llu\n", (unsigned long long)stats->sampled_hits);
+    fprintf(out, "seconds %.6f\n", elapsed);
+}
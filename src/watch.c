@@ -0,0 +1,507 @@
+#include "hw5.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_MIN_BLOCK 4096
+#define WATCH_MAX_BLOCK 65536
+#define WATCH_BOUNDARY_MASK 0x1f
+
+/**
+ * @brief A line-aligned block of the input and where its replaced text sits in the output
+ */
+typedef struct
+{
+    uint64_t checksum; // FNV-1a of the input bytes of the block
+    off_t in_offset;   // Offset of the block in the input
+    off_t in_length;   // Length of the block in the input
+    long line;         // Number of the first line of the block
+    long lines;        // Number of newlines in the block
+    off_t out_offset;  // Offset of the replaced block in the output
+    off_t out_length;  // Length of the replaced block in the output
+} watch_block;
+
+/**
+ * @brief Blocks of the last processed version of the input
+ */
+typedef struct
+{
+    watch_block *blocks;
+    size_t count;
+} watch_state;
+
+static volatile sig_atomic_t stop_watching = 0;
+
+/**
+ * @brief Signal handler ending the watch loop
+ */
+static void handle_stop(int signum)
+{
+    (void)signum;
+    stop_watching = 1;
+}
+
+/**
+ * @brief Splits the input into line-aligned, content-defined blocks, a buffer of whole lines at a time
+ *
+ * A block ends after a line whose hash hits the boundary mask, so an edit only moves the
+ * boundaries around it and the blocks after it keep their checksums. Since matches never
+ * span lines, line-aligned blocks need no extra context to be scanned on their own.
+ *
+ * @param fd Descriptor of the input
+ * @param size Size of the input
+ * @param count Receives the number of blocks
+ * @return watch_block* Newly allocated blocks, NULL on allocation failure or if the input could not
+ * be read to its end
+ */
+static watch_block *split_blocks(int fd, off_t size, size_t *count)
+{
+    size_t capacity = 16;
+    size_t buffer_capacity = COPY_CHUNK;
+    watch_block *blocks = malloc(capacity * sizeof(watch_block));
+    char *buffer = malloc(buffer_capacity);
+    if (!blocks || !buffer)
+    {
+        free(blocks);
+        free(buffer);
+        return NULL;
+    }
+
+    size_t used = 0;
+    off_t start = 0;
+    off_t position = 0;
+    long line = 1;
+    long lines = 0;
+    uint64_t checksum = FNV_OFFSET_BASIS; // Of the block so far, FNV-1a carrying over from line to line
+    ssize_t length;
+
+    while (position < size && (length = read_lines(fd, position, size, &buffer, &buffer_capacity)) > 0)
+    {
+        const char *data = buffer;
+        const char *end = buffer + length;
+        while (data < end)
+        {
+            const char *newline = memchr(data, '\n', end - data);
+            const char *line_end = newline ? newline + 1 : end;
+            uint64_t line_hash = fnv1a(FNV_OFFSET_BASIS, data, line_end - data);
+            checksum = fnv1a(checksum, data, line_end - data);
+            lines += newline != NULL;
+            data = line_end;
+
+            off_t cursor = position + (line_end - buffer);
+            off_t block_size = cursor - start;
+            if (cursor == size || block_size >= WATCH_MAX_BLOCK ||
+                (block_size >= WATCH_MIN_BLOCK && (line_hash & WATCH_BOUNDARY_MASK) == 0))
+            {
+                if (used == capacity)
+                {
+                    capacity *= 2;
+                    watch_block *grown = realloc(blocks, capacity * sizeof(watch_block));
+                    if (!grown)
+                    {
+                        free(blocks);
+                        free(buffer);
+                        return NULL;
+                    }
+                    blocks = grown;
+                }
+
+                watch_block *block = &blocks[used++];
+                block->checksum = checksum;
+                block->in_offset = start;
+                block->in_length = block_size;
+                block->line = line;
+                block->lines = lines;
+                block->out_offset = 0;
+                block->out_length = 0;
+
+                line += lines;
+                lines = 0;
+                start = cursor;
+                checksum = FNV_OFFSET_BASIS;
+            }
+        }
+        position += length;
+    }
+
+    free(buffer);
+    if (position < size)
+    {
+        // A read error, or the input shrank while it was read; the next event retries
+        free(blocks);
+        return NULL;
+    }
+    *count = used;
+    return blocks;
+}
+
+/**
+ * @brief Orders blocks by checksum, then by first line
+ */
+static int compare_blocks(const void *a, const void *b)
+{
+    const watch_block *x = a;
+    const watch_block *y = b;
+    if (x->checksum != y->checksum)
+        return x->checksum < y->checksum ? -1 : 1;
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+/**
+ * @brief Finds a block of the previous run whose replaced text can be reused for a new block
+ *
+ * @param sorted Previous blocks sorted with compare_blocks()
+ * @param count Number of previous blocks
+ * @param block New block
+ * @param options Replacement options
+ * @return const watch_block* Reusable block, NULL if the block must be scanned again
+ */
+static const watch_block *find_reusable(const watch_block *sorted, size_t count, const watch_block *block,
+                                        const replace_options *options)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (sorted[middle].checksum < block->checksum)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    for (size_t i = low; i < count && sorted[i].checksum == block->checksum; i++)
+    {
+        const watch_block *old = &sorted[i];
+        long old_last = old->line + old->lines;
+        long new_last = block->line + block->lines;
+
+        // The replaced text only depends on the line numbers when part of the block is in the -l range
+        int old_outside = old_last < options->minimum || old->line > options->maximum;
+        int new_outside = new_last < options->minimum || block->line > options->maximum;
+        int old_inside = old->line >= options->minimum && old_last <= options->maximum;
+        int new_inside = block->line >= options->minimum && new_last <= options->maximum;
+
+        if (old->in_length == block->in_length &&
+            (old->line == block->line || (old_outside && new_outside) || (old_inside && new_inside)))
+        {
+            return old;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs the replacement over a single block, read from the input
+ *
+ * The block must still have the checksum it was split with, so an input written to during the
+ * refresh fails it instead of pairing the old checksum with new text.
+ *
+ * @param fd Descriptor of the input
+ * @param block Block to process
+ * @param options Replacement options
+ * @param input Read buffer, grown to the block
+ * @param capacity Capacity of the read buffer, updated
+ * @param output Buffer receiving the replaced text, emptied first
+ * @return int 0 on success, -1 if the block could not be read or has changed
+ */
+static int replace_block(int fd, const watch_block *block, const replace_options *options, char **input,
+                         size_t *capacity, text_buffer *output)
+{
+    if ((size_t)block->in_length > *capacity)
+    {
+        char *grown = realloc(*input, block->in_length);
+        if (!grown)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *input = grown;
+        *capacity = block->in_length;
+    }
+
+    if (pread(fd, *input, block->in_length, block->in_offset) != block->in_length ||
+        fnv1a(FNV_OFFSET_BASIS, *input, block->in_length) != block->checksum)
+        return -1;
+
+    output->length = 0;
+    replace_span(*input, block->in_length, options, block->line, UINT64_MAX, output);
+    return 0;
+}
+
+/**
+ * @brief Copies a binary input to the output as it is, through a temporary file
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int pass_binary(int fd, off_t size, const char *outputFile)
+{
+    char *tempFile = NULL;
+    FILE *optr = open_in_place_output(outputFile, &tempFile);
+    if (!optr)
+        return -1;
+
+    int result = copy_range(fd, 0, size, fileno(optr));
+    if (fclose(optr) != 0 || result != 0 || rename(tempFile, outputFile) != 0)
+    {
+        unlink(tempFile);
+        result = -1;
+    }
+    free(tempFile);
+    return result;
+}
+
+/**
+ * @brief Brings the output up to date with the input, rescanning only the blocks that changed
+ *
+ * When every block keeps its place and size in the output the changed blocks are written over
+ * the old ones; they are scanned once to size them and again to write them. Otherwise a new
+ * output is assembled from copies of the unchanged blocks and the rescanned ones, then renamed
+ * over the old output. The input is read a block at a time, so memory does not grow with it.
+ *
+ * A binary input is passed or skipped as a whole, as --binary says, and the blocks of the last
+ * text version are forgotten.
+ *
+ * @param inputFile Name of the input file
+ * @param outputFile Name of the output file
+ * @param options Replacement options
+ * @param binaryMode BINARY_PASS, BINARY_SKIP or BINARY_TEXT
+ * @param state Blocks of the previous run, updated on success and emptied on failure
+ * @return int 0 on success, -1 on failure
+ */
+static int refresh_output(const char *inputFile, const char *outputFile, const replace_options *options,
+                          int binaryMode, watch_state *state)
+{
+    int fd = open(inputFile, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    size_t count = 0;
+    watch_block *blocks = NULL;
+    const watch_block **reused = NULL;
+    watch_block *sorted = NULL;
+    size_t capacity = COPY_CHUNK;
+    char *input = malloc(capacity);
+    text_buffer replaced = {NULL, 0, 0};
+    int old_fd = -1;
+    int result = -1;
+
+    if (binaryMode != BINARY_TEXT && sniff_file(fd) == FILE_BINARY)
+    {
+        result = binaryMode == BINARY_SKIP ? 0 : pass_binary(fd, st.st_size, outputFile);
+        free(state->blocks);
+        state->blocks = NULL;
+        state->count = 0;
+        goto done;
+    }
+
+    blocks = split_blocks(fd, st.st_size, &count);
+    reused = calloc(count ? count : 1, sizeof(watch_block *));
+    if (!input || !blocks || !reused)
+        goto done;
+
+    if (state->count)
+    {
+        sorted = malloc(state->count * sizeof(watch_block));
+        if (!sorted)
+            goto done;
+        memcpy(sorted, state->blocks, state->count * sizeof(watch_block));
+        qsort(sorted, state->count, sizeof(watch_block), compare_blocks);
+    }
+
+    old_fd = open(outputFile, O_RDONLY);
+    int same_layout = old_fd >= 0 && count == state->count;
+    off_t out_offset = 0;
+
+    // Rescanned blocks are only sized here while the output may still be patched in place
+    for (size_t i = 0; i < count; i++)
+    {
+        reused[i] = old_fd >= 0 ? find_reusable(sorted, state->count, &blocks[i], options) : NULL;
+        if (!same_layout)
+            continue;
+
+        if (reused[i])
+        {
+            blocks[i].out_length = reused[i]->out_length;
+        }
+        else
+        {
+            if (replace_block(fd, &blocks[i], options, &input, &capacity, &replaced) != 0)
+                goto done;
+            blocks[i].out_length = replaced.length;
+        }
+
+        blocks[i].out_offset = out_offset;
+        out_offset += blocks[i].out_length;
+
+        if (reused[i] ? reused[i]->out_offset != blocks[i].out_offset
+                      : state->blocks[i].out_offset != blocks[i].out_offset ||
+                            state->blocks[i].out_length != blocks[i].out_length)
+        {
+            same_layout = 0;
+        }
+    }
+
+    if (same_layout)
+    {
+        // Unchanged blocks are already in place, patch the others over their old text
+        int out_fd = open(outputFile, O_WRONLY);
+        result = out_fd >= 0 ? 0 : -1;
+        for (size_t i = 0; i < count && result == 0; i++)
+        {
+            if (!reused[i])
+            {
+                result = replace_block(fd, &blocks[i], options, &input, &capacity, &replaced);
+                if (result == 0)
+                    result = pwrite_all(out_fd, replaced.data, replaced.length, blocks[i].out_offset);
+            }
+        }
+        if (out_fd >= 0)
+            close(out_fd);
+    }
+    else
+    {
+        char *tempFile = NULL;
+        FILE *optr = open_in_place_output(outputFile, &tempFile);
+        result = optr ? 0 : -1;
+        if (optr)
+        {
+            int out_fd = fileno(optr);
+            out_offset = 0;
+            for (size_t i = 0; i < count && result == 0; i++)
+            {
+                blocks[i].out_offset = out_offset;
+                if (reused[i])
+                {
+                    blocks[i].out_length = reused[i]->out_length;
+                    result = copy_range(old_fd, reused[i]->out_offset, reused[i]->out_length, out_fd);
+                }
+                else
+                {
+                    result = replace_block(fd, &blocks[i], options, &input, &capacity, &replaced);
+                    blocks[i].out_length = replaced.length;
+                    if (result == 0)
+                        result = pwrite_all(out_fd, replaced.data, replaced.length, out_offset);
+                }
+                out_offset += blocks[i].out_length;
+                if (result == 0 && lseek(out_fd, out_offset, SEEK_SET) < 0)
+                    result = -1;
+            }
+            if (fclose(optr) != 0 || result != 0 || rename(tempFile, outputFile) != 0)
+            {
+                unlink(tempFile);
+                result = -1;
+            }
+        }
+        free(tempFile);
+    }
+
+    if (result == 0)
+    {
+        free(state->blocks);
+        state->blocks = blocks;
+        state->count = count;
+        blocks = NULL;
+    }
+
+done:
+    // A failed patch may have left the output half updated, so the next refresh rebuilds it whole
+    if (result != 0)
+    {
+        free(state->blocks);
+        state->blocks = NULL;
+        state->count = 0;
+    }
+    if (old_fd >= 0)
+        close(old_fd);
+    close(fd);
+    free(reused);
+    free(sorted);
+    free(blocks);
+    free(input);
+    free(replaced.data);
+    return result;
+}
+
+/**
+ * @brief Keeps the output in sync with the input until interrupted, reprocessing only what changed
+ *
+ * The parent directory is watched rather than the file so that editors which save by renaming
+ * a new file over the old one are noticed too.
+ *
+ * @param inputFile Name of the input file
+ * @param outputFile Name of the output file
+ * @param options Replacement options
+ * @param binaryMode What to do when the input is binary, as for --binary
+ * @return int 0 when stopped by SIGINT or SIGTERM, -1 on failure
+ */
+int watch_and_replace(const char *inputFile, const char *outputFile, const replace_options *options, int binaryMode)
+{
+    watch_state state = {NULL, 0};
+    char *directory_copy = strdup(inputFile);
+    char *name_copy = strdup(inputFile);
+    int fd = inotify_init1(IN_CLOEXEC);
+    int result = -1;
+
+    if (!directory_copy || !name_copy || fd < 0)
+        goto done;
+
+    const char *directory = dirname(directory_copy);
+    const char *name = basename(name_copy);
+
+    if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+        goto done;
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (refresh_output(inputFile, outputFile, options, binaryMode, &state) != 0)
+        goto done;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!stop_watching)
+    {
+        ssize_t got = read(fd, events, sizeof(events));
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto done;
+        }
+
+        int changed = 0;
+        for (char *cursor = events; cursor < events + got;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)cursor;
+            if (event->len && strcmp(event->name, name) == 0)
+                changed = 1;
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+
+        // A failed refresh (e.g. the input vanished mid-save) is retried on the next event
+        if (changed)
+            refresh_output(inputFile, outputFile, options, binaryMode, &state);
+    }
+    result = 0;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    free(state.blocks);
+    free(directory_copy);
+    free(name_copy);
+    return result;
+}
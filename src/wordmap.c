@@ -0,0 +1,423 @@
+#include "hw5.h"
+
+#include <sys/mman.h>
+
+#define EMPTY_SLOT UINT64_MAX
+#define MAP_MAX_SEED (1u << 20) // Seeds tried per bucket before the keys are deemed impossible to place
+
+/**
+ * @brief Hashes a key under a seed; seed 0 picks the bucket, the bucket's seed picks the slot
+ */
+static uint64_t key_hash(uint32_t seed, const char *key, size_t length)
+{
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS ^ (seed * 0x9e3779b97f4a7c15ULL), key, length);
+
+    // FNV-1a leaves the low bits of short keys poorly mixed, and slots are taken modulo the key count
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * @brief Copies a string into the map's storage
+ *
+ * @return size_t Offset of the copy
+ */
+static size_t store_string(word_map *map, const char *text, size_t length)
+{
+    size_t offset = map->strings.length;
+    buffer_append(&map->strings, text, length);
+    return offset;
+}
+
+/**
+ * @brief Sets up an empty word map
+ *
+ * @param map Word map to initialize
+ */
+void init_map(word_map *map)
+{
+    memset(map, 0, sizeof(*map));
+    map->shortest = SIZE_MAX;
+    map->digest = FNV_OFFSET_BASIS;
+}
+
+/**
+ * @brief Adds a mapping; of several mappings for one key, the first added wins
+ *
+ * @param map Word map, not built yet
+ * @param key Whole word to replace
+ * @param value Text replacing it
+ * @return int 0 on success, WILDCARD_INVALID if the key is empty or is not a single word
+ */
+int add_mapping(word_map *map, const char *key, const char *value)
+{
+    size_t key_length = strlen(key);
+    size_t value_length = strlen(value);
+    if (key_length == 0 || skip_word(key, key + key_length) != key + key_length)
+        return WILDCARD_INVALID;
+
+    if (map->count == map->capacity)
+    {
+        size_t grown = map->capacity ? map->capacity * 2 : 64;
+        map_entry *resized = realloc(map->entries, grown * sizeof(map_entry));
+        if (!resized)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        map->entries = resized;
+        map->capacity = grown;
+    }
+
+    map_entry *entry = &map->entries[map->count++];
+    entry->key = store_string(map, key, key_length);
+    entry->key_length = key_length;
+    entry->value = store_string(map, value, value_length);
+    entry->value_length = value_length;
+
+    if (key_length < map->shortest)
+        map->shortest = key_length;
+    if (key_length > map->longest)
+        map->longest = key_length;
+    map->digest = fnv1a(map->digest, key, key_length + 1);
+    map->digest = fnv1a(map->digest, value, value_length + 1);
+    return 0;
+}
+
+/**
+ * @brief Adds the mappings of a file, one "word<TAB>replacement" per line
+ *
+ * Empty lines and lines starting with '#' are skipped.
+ *
+ * @param map Word map, not built yet
+ * @param path Path of the map file
+ * @return int 0 on success, INPUT_FILE_MISSING if the file cannot be read, WILDCARD_INVALID for a bad line
+ */
+int load_map(word_map *map, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return INPUT_FILE_MISSING;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int status = 0;
+
+    while (status == 0 && (length = getline(&line, &capacity, file)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length > 0 && line[length - 1] == '\r')
+            line[--length] = '\0';
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        char *tab = strchr(line, '\t');
+        if (!tab)
+        {
+            status = WILDCARD_INVALID;
+            break;
+        }
+        *tab = '\0';
+        status = add_mapping(map, line, tab + 1);
+    }
+
+    free(line);
+    fclose(file);
+    return status;
+}
+
+/**
+ * @brief Packs the entry held by a slot with a fingerprint of its key, the high half of its bucket hash
+ */
+static uint64_t slot_value(const uint64_t *hashes, size_t entry)
+{
+    return (hashes[entry] & 0xffffffff00000000ULL) | (uint32_t)entry;
+}
+
+/**
+ * @brief Bucket of the displacement order, largest first
+ */
+typedef struct
+{
+    size_t bucket;
+    size_t start; // First of its entries in the bucket order
+    size_t size;  // Distinct keys in the bucket
+} map_bucket;
+
+static int larger_bucket(const void *a, const void *b)
+{
+    const map_bucket *left = a;
+    const map_bucket *right = b;
+    if (left->size != right->size)
+        return left->size < right->size ? 1 : -1;
+    return left->bucket < right->bucket ? -1 : left->bucket > right->bucket;
+}
+
+/**
+ * @brief Builds the minimal perfect hash of the keys, once every mapping is added
+ *
+ * Keys are spread over as many buckets as there are mappings. Buckets are placed largest first: a
+ * bucket of several keys gets the first seed that sends all of them to free slots, and a bucket of
+ * one key is sent straight to a free slot. Equal keys always share a bucket, where only the first
+ * one added is kept; the others are dropped before any bucket is placed, since no seed could ever
+ * separate them.
+ *
+ * @param map Word map
+ * @return int 0 on success, WILDCARD_INVALID if there are too many keys or no seed up to MAP_MAX_SEED
+ * places some bucket
+ */
+int build_map(word_map *map)
+{
+    size_t count = map->count;
+    if (count == 0)
+        return 0;
+    if (count > INT32_MAX)
+        return WILDCARD_INVALID; // Seeds could not name every slot
+
+    uint64_t *hashes = malloc(count * sizeof(uint64_t));
+    size_t *first = calloc(count + 1, sizeof(size_t));
+    size_t *fill = malloc(count * sizeof(size_t));
+    size_t *order = malloc(count * sizeof(size_t));
+    map_bucket *buckets = malloc(count * sizeof(map_bucket));
+    map->seeds = calloc(count, sizeof(int32_t));
+    if (!hashes || !first || !fill || !order || !buckets || !map->seeds)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Group the entries by bucket, keeping the order they were added in
+    for (size_t i = 0; i < count; i++)
+    {
+        const map_entry *entry = &map->entries[i];
+        hashes[i] = key_hash(0, map->strings.data + entry->key, entry->key_length);
+        first[hashes[i] % count + 1]++;
+    }
+    for (size_t b = 0; b < count; b++)
+        first[b + 1] += first[b];
+    memcpy(fill, first, count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++)
+        order[fill[hashes[i] % count]++] = i;
+
+    // Drop the later duplicates of a key, compacting each bucket's entries
+    size_t distinct = 0;
+    size_t bucket_count = 0;
+    for (size_t b = 0; b < count; b++)
+    {
+        size_t kept = 0;
+        for (size_t i = first[b]; i < first[b + 1]; i++)
+        {
+            const map_entry *entry = &map->entries[order[i]];
+            int duplicate = 0;
+            for (size_t j = first[b]; j < first[b] + kept && !duplicate; j++)
+            {
+                const map_entry *other = &map->entries[order[j]];
+                duplicate = other->key_length == entry->key_length &&
+                            memcmp(map->strings.data + other->key, map->strings.data + entry->key, entry->key_length) == 0;
+            }
+            if (!duplicate)
+                order[first[b] + kept++] = order[i];
+        }
+        if (kept > 0)
+            buckets[bucket_count++] = (map_bucket){b, first[b], kept};
+        distinct += kept;
+    }
+    qsort(buckets, bucket_count, sizeof(map_bucket), larger_bucket);
+
+    map->slot_count = distinct;
+    map->slots = malloc(distinct * sizeof(uint64_t));
+    if (!map->slots)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < distinct; s++)
+        map->slots[s] = EMPTY_SLOT;
+
+    size_t chosen_capacity = buckets[0].size;
+    size_t *chosen = malloc(chosen_capacity * sizeof(size_t));
+    if (!chosen)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int status = 0;
+    size_t next_free = 0;
+    for (size_t k = 0; k < bucket_count && status == 0; k++)
+    {
+        const map_bucket *bucket = &buckets[k];
+        if (bucket->size == 1)
+        {
+            while (map->slots[next_free] != EMPTY_SLOT)
+                next_free++;
+            map->slots[next_free] = slot_value(hashes, order[bucket->start]);
+            map->seeds[bucket->bucket] = -(int32_t)next_free - 1;
+            continue;
+        }
+
+        status = WILDCARD_INVALID;
+        for (uint32_t seed = 1; seed <= MAP_MAX_SEED; seed++)
+        {
+            size_t placed = 0;
+            for (; placed < bucket->size; placed++)
+            {
+                const map_entry *entry = &map->entries[order[bucket->start + placed]];
+                size_t slot = key_hash(seed, map->strings.data + entry->key, entry->key_length) % distinct;
+                int taken = map->slots[slot] != EMPTY_SLOT;
+                for (size_t j = 0; j < placed && !taken; j++)
+                    taken = chosen[j] == slot;
+                if (taken)
+                    break;
+                chosen[placed] = slot;
+            }
+
+            if (placed == bucket->size)
+            {
+                for (size_t j = 0; j < placed; j++)
+                    map->slots[chosen[j]] = slot_value(hashes, order[bucket->start + j]);
+                map->seeds[bucket->bucket] = (int32_t)seed;
+                status = 0;
+                break;
+            }
+        }
+    }
+
+    free(chosen);
+    free(buckets);
+    free(order);
+    free(fill);
+    free(first);
+    free(hashes);
+    return status;
+}
+
+/**
+ * @brief Sets up the word map of a --map run from a compiled file, or builds it from a text file whose
+ * entries come after the -s/-r pair when one is given
+ *
+ * @param map Word map to fill in; released with free_map() whatever the result
+ * @param path Path of the map file
+ * @param search -s text, NULL when not given
+ * @param replace -r text, NULL when not given
+ * @return int 0 on success, MISSING_ARGUMENT for a compiled file given with -s and -r, otherwise the
+ * status of load_compiled_map(), add_mapping(), load_map() or build_map()
+ */
+int open_map(word_map *map, const char *path, const char *search, const char *replace)
+{
+    init_map(map);
+    int status = load_compiled_map(map, path);
+    if (status == 0 && search)
+        return MISSING_ARGUMENT;
+    if (status < 0)
+    {
+        status = search ? add_mapping(map, search, replace) : 0;
+        if (status == 0)
+            status = load_map(map, path);
+        if (status == 0)
+            status = build_map(map);
+    }
+    return status;
+}
+
+/**
+ * @brief Releases a word map
+ *
+ * @param map Word map
+ */
+void free_map(word_map *map)
+{
+    if (map->mapping)
+    {
+        munmap(map->mapping, map->mapping_length);
+        return;
+    }
+    free(map->strings.data);
+    free(map->entries);
+    free(map->seeds);
+    free(map->slots);
+}
+
+/**
+ * @brief Finds the mapping of a word, with two hashes, a fingerprint check and one key compare
+ *
+ * @param map Built word map
+ * @param word Word, which need not be NUL-terminated
+ * @param length Length of the word
+ * @return int Index of the entry, -1 if the word is not a key
+ */
+int lookup_map(const word_map *map, const char *word, size_t length)
+{
+    if (map->slot_count == 0 || length < map->shortest || length > map->longest)
+        return -1;
+
+    uint64_t hash = key_hash(0, word, length);
+    int32_t seed = map->seeds[hash % map->count];
+    size_t slot = seed < 0 ? (size_t)(-(seed + 1)) : key_hash(seed, word, length) % map->slot_count;
+
+    // A compiled map is used as it was mapped, so the slot, entry and offsets read from it are
+    // checked before they are followed; a corrupted file then misses words instead of crashing
+    if (slot >= map->slot_count)
+        return -1;
+
+    // Most words that are not keys differ in the fingerprint, without a look at the entries
+    uint64_t value = map->slots[slot];
+    if ((value ^ hash) >> 32)
+        return -1;
+
+    uint32_t index = (uint32_t)value;
+    if (index >= map->count)
+        return -1;
+    const map_entry *entry = &map->entries[index];
+
+    if (entry->key_length != length || length > map->strings.length || entry->key > map->strings.length - length ||
+        entry->value > map->strings.length || entry->value_length > map->strings.length - entry->value ||
+        memcmp(map->strings.data + entry->key, word, length) != 0)
+        return -1;
+    return (int)index;
+}
+
+/**
+ * @brief Replaces every word of a line that is a key of the map
+ *
+ * @param line Line to search
+ * @param length Length of the line
+ * @param map Built word map
+ * @param limit Most words to replace, UINT64_MAX for no limit
+ * @param output Buffer the modified line is appended to
+ * @return int Number of words replaced
+ */
+int map_replace(const char *line, size_t length, const word_map *map, uint64_t limit, text_buffer *output)
+{
+    const char *end = line + length;
+    const char *cursor = line;
+    const char *copied = line;
+    int replaced = 0;
+
+    while ((uint64_t)replaced < limit && cursor < end)
+    {
+        const char *word = skip_non_word_characters(cursor, end);
+        cursor = skip_word(word, end);
+        if (cursor == word)
+            break;
+
+        int index = lookup_map(map, word, cursor - word);
+        if (index >= 0)
+        {
+            const map_entry *entry = &map->entries[index];
+            buffer_append(output, copied, word - copied);
+            buffer_append(output, map->strings.data + entry->value, entry->value_length);
+            copied = cursor;
+            replaced++;
+        }
+    }
+
+    buffer_append(output, copied, end - copied);
+    return replaced;
+}
@@ -0,0 +1,212 @@
+/*
+Scale tests: inputs of 10 MB up to 5 GB are generated and run through ./bin/hw5, with a ceiling on
+peak RSS and on how much slower per byte a larger input may be than a smaller one. They are built
+and run by "make scale", not with the unit tests. HW5_SCALE_MAX_MB stops the ladder at a smaller
+size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "criterion/criterion.h"
+
+#define SCALE_DIR "tests.scale"
+#define SCALE_TIMEOUT 3600
+#define SCALE_DEFAULT_MAX_MB 5120
+#define SCALE_MIN_SECONDS 0.25        // CPU time under which a run is too short to extrapolate from
+#define SCALE_SLACK 2.0               // How much slower per byte a larger input may run than the baseline
+#define SCALE_RSS_BASE_KB (32 * 1024) // Peak RSS allowed whatever the input
+#define SCALE_RSS_LINE_FACTOR 4       // Plus this many times the line, which is held whole with its output
+#define SCALE_BLOCK (1 << 20)
+
+static const long sizes_mb[] = {10, 40, 160, 640, 2560, 5120};
+
+/**
+ * @brief Workload of a scale test: an input made of one line repeated, and the options run over it
+ */
+typedef struct
+{
+    const char *name;
+    const char *options; // Options given before the file names
+    const char *word;    // Text repeated to build the line
+    size_t repeat;       // Times the word is repeated in the line, before its newline
+    long growth;         // Bytes the line gains in the output, negative when it shrinks
+} scale_case;
+
+/**
+ * @brief What one run of ./bin/hw5 cost
+ */
+typedef struct
+{
+    int status;        // Wait status
+    double seconds;    // User and system CPU time
+    long rss_kb;       // Peak resident set size
+    off_t output_size; // Size of the output, -1 if it is missing
+} scale_run;
+
+TestSuite(scale, .timeout=SCALE_TIMEOUT);
+
+/**
+ * @brief Largest input size to run, from HW5_SCALE_MAX_MB
+ */
+static long max_mb(void)
+{
+    const char *value = getenv("HW5_SCALE_MAX_MB");
+    long limit = value ? strtol(value, NULL, 10) : 0;
+    return limit > 0 ? limit : SCALE_DEFAULT_MAX_MB;
+}
+
+/**
+ * @brief Writes an input of about size_mb megabytes, in whole lines
+ *
+ * @return size_t Number of lines written
+ */
+static size_t write_input(const char *path, const scale_case *test, long size_mb)
+{
+    size_t word_length = strlen(test->word);
+    size_t line_length = word_length * test->repeat + 1;
+    size_t per_block = line_length < SCALE_BLOCK ? SCALE_BLOCK / line_length : 1;
+    char *block = malloc(per_block * line_length);
+    cr_assert_not_null(block, "Could not allocate the input block.\n");
+
+    for (size_t i = 0; i < test->repeat; i++)
+        memcpy(block + i * word_length, test->word, word_length);
+    block[line_length - 1] = '\n';
+    for (size_t i = 1; i < per_block; i++)
+        memcpy(block + i * line_length, block, line_length);
+
+    size_t lines = (size_t)size_mb * 1024 * 1024 / line_length;
+    if (lines == 0)
+        lines = 1;
+
+    FILE *file = fopen(path, "w");
+    cr_assert_not_null(file, "Could not create %s.\n", path);
+    for (size_t written = 0; written < lines; written += per_block)
+    {
+        size_t count = lines - written < per_block ? lines - written : per_block;
+        cr_assert_eq(fwrite(block, line_length, count, file), count, "Could not write %s.\n", path);
+    }
+    cr_assert_eq(fclose(file), 0, "Could not write %s.\n", path);
+    free(block);
+    return lines;
+}
+
+/**
+ * @brief Runs ./bin/hw5 with the options of a workload and measures it
+ */
+static scale_run run_case(const scale_case *test, const char *input, const char *output)
+{
+    char cmd[500];
+    snprintf(cmd, sizeof(cmd), "exec ./bin/hw5 %s %s %s >> %s/%s.log 2>&1", test->options, input, output, SCALE_DIR,
+             test->name);
+
+    scale_run run = {0, 0, 0, -1};
+    struct rusage usage;
+    pid_t pid = fork();
+    cr_assert_geq(pid, 0, "Could not fork.\n");
+    if (pid == 0)
+    {
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    cr_assert_eq(wait4(pid, &run.status, 0, &usage), pid, "Could not wait for ./bin/hw5.\n");
+
+    run.seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    run.rss_kb = usage.ru_maxrss;
+
+    struct stat st;
+    if (stat(output, &st) == 0)
+        run.output_size = st.st_size;
+    return run;
+}
+
+/**
+ * @brief Runs a workload over every input size, checking its output size, its peak RSS and how its
+ * CPU time grows
+ *
+ * The first run long enough to time is the baseline; every larger run must stay within
+ * SCALE_SLACK of the baseline's time per byte, so a quadratic blowup fails long before 5 GB.
+ */
+static void run_ladder(const scale_case *test)
+{
+    char input[100];
+    char output[100];
+    snprintf(input, sizeof(input), "%s/%s.in.txt", SCALE_DIR, test->name);
+    snprintf(output, sizeof(output), "%s/%s.out.txt", SCALE_DIR, test->name);
+    mkdir(SCALE_DIR, 0777);
+
+    size_t line_length = strlen(test->word) * test->repeat + 1;
+    long ceiling_kb = SCALE_RSS_BASE_KB + SCALE_RSS_LINE_FACTOR * (long)(line_length / 1024);
+    double base_seconds = 0;
+    double base_bytes = 0;
+
+    for (size_t i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]) && sizes_mb[i] <= max_mb(); i++)
+    {
+        size_t lines = write_input(input, test, sizes_mb[i]);
+        double bytes = (double)lines * line_length;
+        scale_run run = run_case(test, input, output);
+        unlink(input);
+        unlink(output);
+
+        cr_log_info("%s: %ld MB in %.2f s of CPU, peak RSS %ld KB\n", test->name, sizes_mb[i], run.seconds,
+                    run.rss_kb);
+        cr_expect(WIFEXITED(run.status) && WEXITSTATUS(run.status) == 0,
+                  "%s did not exit normally at %ld MB (status = %d).\n", test->name, sizes_mb[i], run.status);
+        cr_expect_eq(run.output_size, (off_t)(lines * (line_length + test->growth)),
+                     "%s wrote %lld bytes at %ld MB instead of %lld.\n", test->name, (long long)run.output_size,
+                     sizes_mb[i], (long long)(lines * (line_length + test->growth)));
+        cr_expect_leq(run.rss_kb, ceiling_kb, "%s peaked at %ld KB at %ld MB, over the %ld KB ceiling.\n", test->name,
+                      run.rss_kb, sizes_mb[i], ceiling_kb);
+
+        if (base_bytes > 0)
+        {
+            double allowed = base_seconds * (bytes / base_bytes) * SCALE_SLACK;
+            cr_expect_leq(run.seconds, allowed, "%s took %.2f s at %ld MB, over the %.2f s that linear scaling allows.\n",
+                          test->name, run.seconds, sizes_mb[i], allowed);
+        }
+        else if (run.seconds >= SCALE_MIN_SECONDS)
+        {
+            base_seconds = run.seconds;
+            base_bytes = bytes;
+        }
+    }
+}
+
+Test(scale, many_matches, .description="Lines of 4 MB, each holding two million matches.") {
+    scale_case test = {"many_matches", "-s x -r y", "x ", 2 << 20, 0};
+    run_ladder(&test);
+}
+
+Test(scale, growing_replacement, .description="Every match grows by eight bytes.") {
+    scale_case test = {"growing_replacement", "-s the -r \"THE THE THE\"", "the quick brown fox ", 3, 3 * 8};
+    run_ladder(&test);
+}
+
+Test(scale, shrinking_replacement, .description="Every match shrinks by four bytes.") {
+    scale_case test = {"shrinking_replacement", "-s quick -r q", "the quick brown fox ", 3, 3 * -4};
+    run_ladder(&test);
+}
+
+Test(scale, huge_lines, .description="Lines of 64 MB, with a match every twelve bytes.") {
+    scale_case test = {"huge_lines", "-s ipsum -r IPSUM", "lorem ipsum ", (64 << 20) / 12, 0};
+    run_ladder(&test);
+}
+
+Test(scale, wildcard_short_words, .description="A prefix wildcard matching every one-letter word of 64 KB lines.") {
+    scale_case test = {"wildcard_short_words", "-w -s \"a*\" -r bb", "a ", 32768, 32768};
+    run_ladder(&test);
+}
+
+Test(scale, wildcard_long_words, .description="A suffix wildcard matching words of 64 KB.") {
+    static char word[65538 + 1];
+    memset(word, 'a', 65536);
+    strcpy(word + 65536, "b ");
+    scale_case test = {"wildcard_long_words", "-w -s \"*b\" -r c", word, 16, 16 * (1 - 65537)};
+    run_ladder(&test);
+}
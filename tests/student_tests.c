@@ -0,0 +1,520 @@
+#include "unit_tests.h"
+#include "hw5.h"
+
+static char args[ARGS_TEXT_LEN];
+
+/* Starts a daemon listening on TEST_OUTPUT_DIR/<test_name>.sock and waits until it accepts. */
+static void start_daemon(char *test_name) {
+    char cmd[300];
+    char socket_path[100];
+    sprintf(cmd, "./bin/hw5 --daemon %s/%s.sock > /dev/null 2>&1 & echo $! > %s/%s.pid", TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(socket_path, "%s/%s.sock", TEST_OUTPUT_DIR, test_name);
+    for (int i = 0; i < 100 && access(socket_path, F_OK) != 0; i++)
+        usleep(20000);
+}
+
+static void stop_daemon(char *test_name) {
+    char cmd[200];
+    sprintf(cmd, "kill $(cat %s/%s.pid)", TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+}
+
+TestSuite(student_output, .timeout=TEST_TIMEOUT, .disabled=false); // output file
+
+/* Check output file. */
+Test(student_output, index_search01, .description="Perform a simple replacement in a line range using the line index.") {
+    char *test_name = "index_search01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "-s machine -r device -l 23,23 --index %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, index_search02, .description="Perform a wildcard replacement in a line range, reusing the line index built by a previous run.") {
+    char *test_name = "index_search02";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "--index -s *rly -w -r \"WELL TIMED\" -l 11,23 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, index_search03, .description="A line range open to the largest line number runs to the end of the file.") {
+    char *test_name = "index_search03";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE -l 2,9223372036854775807 --index %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, in_place_search01, .description="Patch a same-length replacement directly into the file.") {
+    char *test_name = "in_place_search01";
+    char cmd[200];
+    sprintf(cmd, "cp %s/unix.txt %s/%s.out.txt", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s the -r THE --in-place %s/%s.out.txt", TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, in_place_search02, .description="Rewrite a file in place when the terms have different lengths.") {
+    char *test_name = "in_place_search02";
+    char cmd[200];
+    sprintf(cmd, "cp %s/turing.txt %s/%s.out.txt", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s Turing -r \"TURING THE GREAT\" --in-place %s/%s.out.txt", TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, in_place_search03, .description="Patch a same-length replacement within a line range, keeping an undo journal.") {
+    char *test_name = "in_place_search03";
+    char cmd[200];
+    sprintf(cmd, "cp %s/unix.txt %s/%s.out.txt", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s early -r EARLY -l 11,23 --in-place --journal %s/%s.out.txt", TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, client_fallback01, .description="Fall back to a local run when no daemon listens on the socket.") {
+    char *test_name = "client_fallback01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "--client %s/%s.sock -s the -r WOLFIE %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, daemon_search01, .description="Serve a line range replacement through a running daemon.") {
+    char *test_name = "daemon_search01";
+    prep_files("turing.txt", test_name);
+    start_daemon(test_name);
+    sprintf(args, "--client %s/%s.sock -s the -r WOLFIE -l 4,9 %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    stop_daemon(test_name);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, daemon_binary01, .description="A daemon copies a binary input through unchanged, as a local run does.") {
+    char *test_name = "daemon_binary01";
+    prep_files("binary.dat", test_name);
+    start_daemon(test_name);
+    sprintf(args, "--client %s/%s.sock -s the -r WOLFIE %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    stop_daemon(test_name);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, daemon_map01, .description="Rename words through a map the daemon builds once and reuses, as a local run would.") {
+    char *test_name = "daemon_map01";
+    prep_files("turing.txt", test_name);
+    start_daemon(test_name);
+    sprintf(args, "--client %s/%s.sock --map tests.in.orig/words.tsv %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    int status = run_using_system_no_valgrind(test_name, args);
+    stop_daemon(test_name);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, daemon_buffer01, .description="Send the input bytes to a daemon when the output is a pipe, and write its reply.") {
+    char *test_name = "daemon_buffer01";
+    char cmd[300];
+    char output[100];
+    prep_files("unix.txt", test_name);
+    sprintf(cmd, "mkfifo %s/%s.fifo; (cat %s/%s.fifo > %s/%s.tmp && mv %s/%s.tmp %s/%s.out.txt) &", TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name,
+            TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    start_daemon(test_name);
+    sprintf(args, "--client %s/%s.sock -s the -r WOLFIE %s/%s.in.txt %s/%s.fifo", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    stop_daemon(test_name);
+    sprintf(output, "%s/%s.out.txt", TEST_OUTPUT_DIR, test_name);
+    for (int i = 0; i < 100 && access(output, F_OK) != 0; i++)
+        usleep(20000);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, binary_pass01, .description="Copy a binary input through unchanged.") {
+    char *test_name = "binary_pass01";
+    prep_files("binary.dat", test_name);
+    sprintf(args, "-s the -r WOLFIE --stats %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, binary_skip01, .description="A skipped binary leaves an existing output file as it was.") {
+    char *test_name = "binary_skip01";
+    char cmd[200];
+    prep_files("binary.dat", test_name);
+    sprintf(cmd, "cp %s/unix.txt %s/%s.out.txt", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s the -r WOLFIE --binary skip %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, binary_text01, .description="Still replace in text inputs when binaries are skipped.") {
+    char *test_name = "binary_text01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "-s Turing -r \"TURING THE GREAT\" --binary skip %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, diff_search01, .description="Write only the changed lines as a unified diff.") {
+    char *test_name = "diff_search01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --diff %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, diff_search02, .description="Limit the diff to the lines of the range.") {
+    char *test_name = "diff_search02";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE -l 4,9 --diff=unified %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, diff_patch01, .description="Write the changed lines as a binary patch list of offsets, lengths and new bytes.") {
+    char *test_name = "diff_patch01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --diff=patch %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, word_search01, .description="Replace a literal only where it is a whole word.") {
+    char *test_name = "word_search01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --word %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, word_search02, .description="Whole words end at punctuation as well as spaces.") {
+    char *test_name = "word_search02";
+    prep_files("punctuation.txt", test_name);
+    sprintf(args, "-s mark -r MARK --word %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, wildcard_nul01, .description="NUL bytes end words without ending the line.") {
+    char *test_name = "wildcard_nul01";
+    prep_files("nul.txt", test_name);
+    sprintf(args, "-s fo* -r X -w --binary text %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, max_count_search01, .description="Stop replacing after the first N matches.") {
+    char *test_name = "max_count_search01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --max-count 2 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, field_search01, .description="Replace only inside the second CSV field, quoting values that gain a delimiter.") {
+    char *test_name = "field_search01";
+    prep_files("records.csv", test_name);
+    sprintf(args, "-s the -r a,b --field 2 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, field_search02, .description="A search text holding a quote matches the doubled quote of a quoted field.") {
+    char *test_name = "field_search02";
+    prep_files("records.csv", test_name);
+    sprintf(args, "-s 'x\"y' -r Q --field 2 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, fuzzy_search01, .description="Replace whole words within two edits of a misspelled search word.") {
+    char *test_name = "fuzzy_search01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "-s machnie -r MACHINE --fuzzy 2 --word %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, range_search01, .description="Replace only between start and end markers, in every section they delimit.") {
+    char *test_name = "range_search01";
+    prep_files("sections.txt", test_name);
+    sprintf(args, "-s the -r THE -l \"/BEGIN CONFIG/,/END CONFIG/\" %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, progress_search01, .description="Progress reports do not change the output.") {
+    char *test_name = "progress_search01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "-s Turing -r TURING --progress 1 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, rules_search01, .description="Apply several wildcard rules at once, the longest affix winning.") {
+    char *test_name = "rules_search01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "--rules tests.in.orig/rules.tsv %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, map_search01, .description="Rename whole words through a map file, the first mapping of a word winning.") {
+    char *test_name = "map_search01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "--map tests.in.orig/words.tsv %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, compile_search01, .description="Apply a rule file compiled ahead of time, as the text rule file would.") {
+    char *test_name = "compile_search01";
+    char cmd[200];
+    sprintf(cmd, "./bin/hw5 compile --rules %s/rules.tsv %s/%s.hw5c", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    prep_files("turing.txt", test_name);
+    sprintf(args, "--rules %s/%s.hw5c %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, compile_corrupt01, .description="A compiled map entry pointing outside the file is ignored instead of crashing the run.") {
+    char *test_name = "compile_corrupt01";
+    char cmd[300];
+    sprintf(cmd, "./bin/hw5 compile --map %s/words.tsv %s/%s.hw5c", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    // The first entry, for "machine", follows the 136-byte header; its key offset becomes 1 GiB,
+    // which the header checksum does not cover
+    sprintf(cmd, "printf '\\000\\000\\000\\100' | dd of=%s/%s.hw5c bs=1 seek=136 conv=notrunc 2>/dev/null", TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    prep_files("turing.txt", test_name);
+    sprintf(args, "--map %s/%s.hw5c %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, cache_search01, .description="A run with a result cache writes the same output.") {
+    char *test_name = "cache_search01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --cache %s/%s.cache %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, watch_search01, .description="Keep the output of a line range in sync while the input is edited in place and then grows.") {
+    char *test_name = "watch_search01";
+    char cmd[500];
+    sprintf(cmd, "for i in 1 2 3; do cat %s/turing.txt %s/unix.txt; done > %s/%s.in.txt", TEST_ORIG_DIR, TEST_ORIG_DIR, TEST_INPUT_DIR, test_name);
+    system(cmd);
+    // A same-length edit keeps the layout of the output, which is patched where it lies; a new line then
+    // moves every later block and the line numbers the range is counted in, so the output is rebuilt
+    sprintf(cmd, "(sleep 0.3; sed -i 's/machine/MACHINE/' %s/%s.in.txt; sleep 0.5; sed -i '3i the new line' %s/%s.in.txt; sleep 0.5; "
+                 "pkill -f '^./bin/hw5 .*--watch %s/%s.in.txt') > /dev/null 2>&1 &", TEST_INPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_INPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s the -r WOLFIE -l 40,250 --watch %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, watch_binary01, .description="Watch mode sniffs its input and leaves the output of a skipped binary as it was.") {
+    char *test_name = "watch_binary01";
+    char cmd[300];
+    prep_files("binary.dat", test_name);
+    sprintf(cmd, "cp %s/unix.txt %s/%s.out.txt", TEST_ORIG_DIR, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(cmd, "(sleep 0.5; pkill -f '^./bin/hw5 .*--watch %s/%s.in.txt') > /dev/null 2>&1 &", TEST_INPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "-s the -r WOLFIE --binary skip --watch %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, shard_search01, .description="Every file of a tree is written by exactly one of three shards, and the merged stats sum the shards.") {
+    char *test_name = "shard_search01";
+    char cmd[1000];
+    sprintf(cmd, "mkdir -p %s/%s/sub && cp %s/unix.txt %s/%s/a.txt && cp %s/turing.txt %s/%s/sub/b.txt && cp %s/unix.txt %s/%s/c.txt && cp %s/sections.txt %s/%s/sub/d.txt",
+            TEST_INPUT_DIR, test_name, TEST_ORIG_DIR, TEST_INPUT_DIR, test_name, TEST_ORIG_DIR, TEST_INPUT_DIR, test_name, TEST_ORIG_DIR, TEST_INPUT_DIR, test_name, TEST_ORIG_DIR, TEST_INPUT_DIR, test_name);
+    system(cmd);
+    for (int i = 1; i <= 3; i++)
+    {
+        sprintf(cmd, "./bin/hw5 -s the -r WOLFIE --shard %d/3 %s/%s %s/%s.%d > %s/%s.%d.stats", i, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name, i, TEST_OUTPUT_DIR, test_name, i);
+        cr_expect_eq(system(cmd), 0, "Shard %d of 3 did not exit normally.\n", i);
+    }
+    // The files each shard wrote, then their contents, then the merged stats without the time they took
+    sprintf(args, "--merge-stats %s/%s.1.stats %s/%s.2.stats %s/%s.3.stats", TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    sprintf(cmd, "(for i in 1 2 3; do (cd %s/%s.$i && find . -type f); done | sort; for f in a.txt sub/b.txt c.txt sub/d.txt; do cat %s/%s.*/$f; done; ./bin/hw5 %s | grep -v '^seconds') > %s/%s.out.txt",
+            TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name, args, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_normal_exit(status);
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, cache_search02, .description="A second run over an unchanged input leaves an output that still has the cached digest as it is.") {
+    char *test_name = "cache_search02";
+    char cmd[300];
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --cache %s/%s.cache %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    sprintf(cmd, "./bin/hw5 %s --stats 2>&1 | grep -q '^cache_hits 1$'", args);
+    cr_expect_eq(system(cmd), 0, "The second run did not take its result from the cache.\n");
+    expect_outfile_matches(test_name);
+}
+
+Test(student_output, cache_binary01, .description="Runs that treat binary inputs differently do not share cache entries.") {
+    char *test_name = "cache_binary01";
+    char cmd[300];
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --binary text --cache %s/%s.cache %s/%s.in.txt %s/%s.out.txt", TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    run_using_system_no_valgrind(test_name, args);
+    sprintf(cmd, "./bin/hw5 -s the -r WOLFIE --binary skip --cache %s/%s.cache %s/%s.in.txt %s/%s.out.txt --stats 2>&1 | grep -q '^cache_hits 0$'",
+            TEST_OUTPUT_DIR, test_name, TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    cr_expect_eq(system(cmd), 0, "The --binary skip run took the result of the --binary text run from the cache.\n");
+    expect_outfile_matches(test_name);
+}
+
+TestSuite(student_invalid_args, .timeout=TEST_TIMEOUT); // return code to OS
+
+/* Tests for invalid arguments. */
+Test(student_invalid_args, watch_in_place01, .description="Watch mode needs a separate output file.") {
+    char *test_name = "watch_in_place01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --watch --in-place %s/%s.in.txt", TEST_INPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, journal_invalid01, .description="--journal only applies to --in-place runs.") {
+    char *test_name = "journal_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r THE --journal %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, max_count_invalid01, .description="--max-count needs a positive count.") {
+    char *test_name = "max_count_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --max-count 0 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, field_invalid01, .description="--delim needs --field to say which field it splits out.") {
+    char *test_name = "field_invalid01";
+    prep_files("records.csv", test_name);
+    sprintf(args, "-s the -r WOLFIE --delim , %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, field_invalid02, .description="A line range could start inside a quoted record, so --field takes no -l.") {
+    char *test_name = "field_invalid02";
+    prep_files("records.csv", test_name);
+    sprintf(args, "-s the -r WOLFIE -l 2,3 --field 2 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, fuzzy_invalid01, .description="A search text no longer than the edit budget would match anywhere.") {
+    char *test_name = "fuzzy_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --fuzzy 3 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, map_invalid01, .description="Every key of a map must be a single word.") {
+    char *test_name = "map_invalid01";
+    prep_files("turing.txt", test_name);
+    sprintf(args, "--map tests.in.orig/words_invalid.tsv %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, WILDCARD_INVALID);
+}
+
+Test(student_invalid_args, range_invalid01, .description="A marker range needs both a start and an end address.") {
+    char *test_name = "range_invalid01";
+    prep_files("sections.txt", test_name);
+    sprintf(args, "-s the -r THE -l /BEGIN/ %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, L_ARGUMENT_INVALID);
+}
+
+Test(student_invalid_args, compile_invalid01, .description="The compile subcommand needs both the rule file and the compiled file.") {
+    char *test_name = "compile_invalid01";
+    sprintf(args, "compile --rules %s/rules.tsv", TEST_ORIG_DIR);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, binary_invalid01, .description="Unknown --binary mode.") {
+    char *test_name = "binary_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --binary maybe %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, diff_in_place01, .description="A diff cannot be written over its own input.") {
+    char *test_name = "diff_in_place01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --diff --in-place %s/%s.in.txt", TEST_INPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, progress_invalid01, .description="The progress interval must be a positive number of seconds.") {
+    char *test_name = "progress_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --progress 0 %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, rules_invalid01, .description="Every rule needs a tab between its pattern and its replacement.") {
+    char *test_name = "rules_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "--rules tests.in.orig/rules_invalid.tsv %s/%s.in.txt %s/%s.out.txt", TEST_INPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, WILDCARD_INVALID);
+}
+
+Test(student_invalid_args, shard_invalid01, .description="Shards are numbered from 1 to their count.") {
+    char *test_name = "shard_invalid01";
+    prep_files("unix.txt", test_name);
+    sprintf(args, "-s the -r WOLFIE --shard 3/2 %s %s/%s", TEST_INPUT_DIR, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, MISSING_ARGUMENT);
+}
+
+Test(student_invalid_args, merge_stats_duplicate01, .description="A stats fragment given twice is not counted twice.") {
+    char *test_name = "merge_stats_duplicate01";
+    char cmd[300];
+    prep_files("unix.txt", test_name);
+    sprintf(cmd, "./bin/hw5 -s the -r WOLFIE --shard 1/2 %s %s/%s > %s/%s.stats", TEST_INPUT_DIR, TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    system(cmd);
+    sprintf(args, "--merge-stats %s/%s.stats %s/%s.stats", TEST_OUTPUT_DIR, test_name, TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, DUPLICATE_ARGUMENT);
+}
+
+Test(student_invalid_args, merge_stats_missing01, .description="Every stats fragment to merge must exist.") {
+    char *test_name = "merge_stats_missing01";
+    sprintf(args, "--merge-stats %s/%s.stats", TEST_OUTPUT_DIR, test_name);
+    int status = run_using_system_no_valgrind(test_name, args);
+    expect_error_exit(status, INPUT_FILE_MISSING);
+}